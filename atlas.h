@@ -0,0 +1,118 @@
+// Texture atlas for the patches.
+//
+// Patches are packed into a few large pages with the skyline bottom-left
+// heuristic: each page keeps the top edge of what was placed so far as a list
+// of horizontal segments, and a new rectangle goes where it rests lowest. Pages
+// are filled incrementally, patches added later are copied in place with a
+// partial upload. Consecutive draws from the same page share one texture, so
+// raylib batches them instead of issuing one draw call per patch.
+#define ATLAS_PAGE_SIZE 4096
+#define ATLAS_PADDING 1
+
+struct SkylineNode {
+    int x, y, width;
+};
+
+struct AtlasPage {
+    Texture2D tex = {0};
+    std::vector<SkylineNode> skyline;
+};
+
+struct Atlas {
+    std::vector<AtlasPage> pages;
+};
+
+static int
+skyline_fit(const AtlasPage& page, int i, int w, int h) {
+    // Lowest y at which a w x h rectangle rests when its left side is on node i, -1 if it does not fit.
+    int x = page.skyline[i].x;
+    if (x + w > ATLAS_PAGE_SIZE) return -1;
+    int y = 0;
+    for (int left = w; left > 0; i++) {
+        y = MAXVAL(y, page.skyline[i].y);
+        if (y + h > ATLAS_PAGE_SIZE) return -1;
+        left -= page.skyline[i].width;
+    }
+    return y;
+}
+
+static bool
+skyline_place(AtlasPage& page, int w, int h, int& x, int& y) {
+    int best = -1, best_y = ATLAS_PAGE_SIZE;
+    for (int i = 0; i < (int) page.skyline.size(); i++) {
+        int fit = skyline_fit(page, i, w, h);
+        if (fit >= 0 && fit < best_y) {
+            best = i;
+            best_y = fit;
+        }
+    }
+    if (best < 0) return false;
+    x = page.skyline[best].x;
+    y = best_y;
+
+    // The new segment hides the part of the skyline under it.
+    std::vector<SkylineNode>& sky = page.skyline;
+    sky.insert(sky.begin() + best, (SkylineNode) {x, y + h, w});
+    for (int i = best + 1; i < (int) sky.size(); i++) {
+        int covered = sky[i-1].x + sky[i-1].width - sky[i].x;
+        if (covered <= 0) break;
+        sky[i].x += covered;
+        sky[i].width -= covered;
+        if (sky[i].width > 0) break;
+        sky.erase(sky.begin() + i);
+        i--;
+    }
+    for (int i = 0; i + 1 < (int) sky.size(); i++) {
+        if (sky[i].y != sky[i+1].y) continue;
+        sky[i].width += sky[i+1].width;
+        sky.erase(sky.begin() + i + 1);
+        i--;
+    }
+    return true;
+}
+
+bool
+AtlasAdd(Atlas& atlas, Image image, Texture2D& tex, Rectangle& src) {
+/*
+    Copies an RGBA image into the atlas, opening a new page when needed.
+    On success tex is the page texture and src the image inside it; images
+    larger than a page are not packed and false is returned.
+*/
+    PROFILE_SCOPE("texture upload");
+    int w = image.width + ATLAS_PADDING, h = image.height + ATLAS_PADDING;
+    if (w > ATLAS_PAGE_SIZE || h > ATLAS_PAGE_SIZE) return false;
+    int x, y;
+    AtlasPage *page = nullptr;
+    for (auto & p : atlas.pages) {
+        if (skyline_place(p, w, h, x, y)) {
+            page = &p;
+            break;
+        }
+    }
+    if (!page) {
+        Image blank = GenImageColor(ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE, BLANK);
+        atlas.pages.push_back(AtlasPage());
+        page = &atlas.pages.back();
+        page->tex = LoadTextureFromImage(blank);
+        page->skyline.push_back((SkylineNode) {0, 0, ATLAS_PAGE_SIZE});
+        UnloadImage(blank);
+        skyline_place(*page, w, h, x, y);
+    }
+    src = (Rectangle) {(float) x, (float) y, (float) image.width, (float) image.height};
+    if (image.format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8) {
+        Image copy = ImageCopy(image);
+        ImageFormat(&copy, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+        UpdateTextureRec(page->tex, src, copy.data);
+        UnloadImage(copy);
+    } else {
+        UpdateTextureRec(page->tex, src, image.data);
+    }
+    tex = page->tex;
+    return true;
+}
+
+void
+UnloadAtlas(Atlas& atlas) {
+    for (auto & page : atlas.pages) UnloadTexture(page.tex);
+    atlas.pages.clear();
+}
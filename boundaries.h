@@ -0,0 +1,117 @@
+// Segment boundaries as a packed 1-bit mask, displayed as a separate layer.
+//
+// A pixel is on a boundary when one of its 4 neighbours inside the image has
+// another label. Rows are compared against their shifted copies (left, right,
+// up, down) 64 pixels at a time, in loops the compiler turns into vector
+// compares, and each 64 pixel run is packed into one word. The mask is
+// expanded to a white/transparent tile pyramid that is tinted when drawn, so
+// the background, the colour or the visibility can change without touching it.
+
+struct BoundaryLayer {
+    uint64_t *bits = nullptr; // One bit per pixel, rows padded to 64 pixels
+    int width = 0;
+    int height = 0;
+    int stride = 0;           // Words per row
+    Image overlay = {0};      // Gray-alpha, alpha set on boundaries
+    TilePyramid *pyramid = nullptr;
+};
+
+static inline uint8_t
+boundary_edge_flag(const std::size_t *c, const std::size_t *u, const std::size_t *d, int k, int x, int nx) {
+    uint8_t flag = (c[k] != u[k]) | (c[k] != d[k]);
+    if (x > 0)      flag |= c[k] != c[k-1];
+    if (x < nx - 1) flag |= c[k] != c[k+1];
+    return flag;
+}
+
+static inline uint64_t
+boundary_mask_word(const std::size_t *row, const std::size_t *up, const std::size_t *down, int x0, int n, int nx) {
+    uint8_t flags[64];
+    // The first and last columns have no left/right neighbour.
+    int k0 = x0 == 0 ? 1 : 0;
+    int k1 = x0 + n == nx ? n - 1 : n;
+    const std::size_t *c = row + x0, *u = up + x0, *d = down + x0;
+    #pragma omp simd
+    for (int k = k0; k < k1; k++) {
+        flags[k] = (c[k] != c[k-1]) | (c[k] != c[k+1]) | (c[k] != u[k]) | (c[k] != d[k]);
+    }
+    if (k0 == 1)     flags[0]   = boundary_edge_flag(c, u, d, 0, x0, nx);
+    if (k1 == n - 1) flags[n-1] = boundary_edge_flag(c, u, d, n - 1, x0 + n - 1, nx);
+    uint64_t word = 0;
+    #pragma omp simd reduction(|:word)
+    for (int k = 0; k < n; k++) word |= (uint64_t) flags[k] << k;
+    return word;
+}
+
+void
+boundary_mask_rect(const std::size_t *labels, int nx, int ny, uint64_t *bits, int stride, int y0, int y1, int w0, int w1) {
+/*
+    Recomputes the mask words [w0, w1) of rows [y0, y1).
+    Rows outside the image are replaced by the row itself, which never
+    differs from it, so the image border needs no special case.
+*/
+    ParallelFor(y0, y1, 16, [&](std::size_t lo, std::size_t hi) {
+        for (int y = lo; y < hi; y++) {
+            const std::size_t *row  = labels + (std::size_t) y * nx;
+            const std::size_t *up   = y > 0      ? row - nx : row;
+            const std::size_t *down = y < ny - 1 ? row + nx : row;
+            for (int w = w0; w < w1; w++) {
+                int x0 = w * 64;
+                int n = nx - x0 < 64 ? nx - x0 : 64;
+                bits[(std::size_t) y * stride + w] = boundary_mask_word(row, up, down, x0, n, nx);
+            }
+        }
+    });
+}
+
+static void
+BoundaryLayerUpload(BoundaryLayer& layer, int x0, int y0, int x1, int y1) {
+    // Expands the mask of the rectangle to gray-alpha pixels for the GPU.
+    uint8_t *pixels = (uint8_t*) layer.overlay.data;
+    ParallelFor(y0, y1, 16, [&](std::size_t lo, std::size_t hi) {
+        for (int y = lo; y < hi; y++) {
+            const uint64_t *row = layer.bits + (std::size_t) y * layer.stride;
+            uint8_t *dst = pixels + (std::size_t) y * layer.width * 2;
+            for (int x = x0; x < x1; x++) {
+                dst[x * 2 + 0] = 255;
+                dst[x * 2 + 1] = (row[x >> 6] >> (x & 63)) & 1 ? 255 : 0;
+            }
+        }
+    });
+    if (layer.pyramid) TilePyramidUpdate(layer.pyramid, (Rectangle) {(float) x0, (float) y0, (float) (x1 - x0), (float) (y1 - y0)});
+    else layer.pyramid = TilePyramidCreate(layer.overlay, TILE_REDUCE_MAX); // Keep thin lines at low zoom
+}
+
+void
+UnloadBoundaryLayer(BoundaryLayer& layer) {
+    free(layer.bits);
+    UnloadTilePyramid(layer.pyramid);
+    if (layer.overlay.data) UnloadImage(layer.overlay);
+    layer = BoundaryLayer();
+}
+
+void
+BoundaryLayerUpdate(BoundaryLayer& layer, const std::size_t *labels, int nx, int ny, Rectangle pixels) {
+    // Refreshes the mask around an edit, or everywhere if the label map was resized.
+    PROFILE_SCOPE("boundaries");
+    if (layer.width != nx || layer.height != ny || layer.bits == nullptr) {
+        UnloadBoundaryLayer(layer);
+        layer.width = nx;
+        layer.height = ny;
+        layer.stride = (nx + 63) / 64;
+        layer.bits = (uint64_t*) calloc((std::size_t) layer.stride * ny, sizeof(uint64_t));
+        layer.overlay = GenImageColor(nx, ny, BLANK);
+        ImageFormat(&layer.overlay, PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA);
+        assert(layer.bits && layer.overlay.data);
+        pixels = (Rectangle) {0, 0, (float) nx, (float) ny};
+    }
+    // One pixel halo: neighbours of an edited pixel may change state too.
+    int x0 = fmax(floorf(pixels.x) - 1, 0), y0 = fmax(floorf(pixels.y) - 1, 0);
+    int x1 = fmin(ceilf(pixels.x + pixels.width) + 1, nx);
+    int y1 = fmin(ceilf(pixels.y + pixels.height) + 1, ny);
+    if (x1 <= x0 || y1 <= y0) return;
+    int w0 = x0 / 64, w1 = (x1 + 63) / 64;
+    boundary_mask_rect(labels, nx, ny, layer.bits, layer.stride, y0, y1, w0, w1);
+    BoundaryLayerUpload(layer, x0, y0, x1, y1);
+}
+
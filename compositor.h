@@ -0,0 +1,177 @@
+// CPU compositor: images placed like DrawTexturePro would, into an image of any size.
+//
+// A layer is a source rectangle of an RGBA image mapped onto a destination
+// rectangle rotated around its top-left corner, tinted and alpha blended over
+// what is below, as with the default raylib blend mode. Every output pixel is
+// mapped back into the layers covering it, so there is no texture size limit
+// and no window is needed. The output is cut in square tiles composited in
+// parallel; each tile only visits the layers whose bounds overlap it.
+//
+// Bilinear sampling takes one sample at the pixel centre. Area sampling
+// averages a grid of samples over the pixel footprint when a layer is
+// shrunk, which also antialiases its edges.
+#define COMPOSITE_TILE 64
+#define COMPOSITE_MAX_SAMPLES 8
+
+enum CompositeFilter { COMPOSITE_BILINEAR, COMPOSITE_AREA };
+
+struct CompositeLayer {
+    Image image;            // R8G8B8A8, not owned
+    Rectangle src;          // Part of the image drawn, in image pixels
+    Rectangle dest;         // Output pixels, the rotation is around (dest.x, dest.y)
+    float rotation;         // Degrees
+    Color tint;
+};
+
+Rectangle
+CompositeLayerBounds(const CompositeLayer& l) {
+    // Axis aligned box around the rotated destination, in output pixels.
+    float c = cosf(l.rotation * DEG2RAD), s = sinf(l.rotation * DEG2RAD);
+    float x0 = l.dest.x, y0 = l.dest.y, x1 = x0, y1 = y0;
+    Vector2 corners[3] = {{l.dest.width, 0}, {0, l.dest.height}, {l.dest.width, l.dest.height}};
+    for (auto & v : corners) {
+        float x = l.dest.x + v.x * c - v.y * s, y = l.dest.y + v.x * s + v.y * c;
+        x0 = fminf(x0, x); y0 = fminf(y0, y);
+        x1 = fmaxf(x1, x); y1 = fmaxf(y1, y);
+    }
+    return (Rectangle) {x0, y0, x1 - x0, y1 - y0};
+}
+
+static inline void
+composite_bilinear(const Image& im, const Rectangle& src, float u, float v, float out[4]) {
+    // Texel centres at half integers, clamped to the source rectangle.
+    float x = fminf(fmaxf(u - 0.5f, src.x), src.x + src.width - 1);
+    float y = fminf(fmaxf(v - 0.5f, src.y), src.y + src.height - 1);
+    int xa = x, ya = y;
+    int xb = xa + 1 < src.x + src.width ? xa + 1 : xa;
+    int yb = ya + 1 < src.y + src.height ? ya + 1 : ya;
+    float fx = x - xa, fy = y - ya;
+    const uint8_t *p = (const uint8_t*) im.data;
+    const uint8_t *a = p + ((std::size_t) ya * im.width + xa) * 4;
+    const uint8_t *b = p + ((std::size_t) ya * im.width + xb) * 4;
+    const uint8_t *c = p + ((std::size_t) yb * im.width + xa) * 4;
+    const uint8_t *d = p + ((std::size_t) yb * im.width + xb) * 4;
+    for (int k = 0; k < 4; k++) {
+        out[k] = (a[k] * (1 - fx) + b[k] * fx) * (1 - fy) + (c[k] * (1 - fx) + d[k] * fx) * fy;
+    }
+}
+
+static void
+composite_tile(Image& out, const std::vector<CompositeLayer>& layers, const std::vector<Rectangle>& bounds,
+               int x0, int y0, int x1, int y1, CompositeFilter filter) {
+    uint8_t *pixels = (uint8_t*) out.data;
+    Rectangle tile = {(float) x0, (float) y0, (float) (x1 - x0), (float) (y1 - y0)};
+    for (std::size_t l = 0; l < layers.size(); l++) {
+        if (!layers[l].image.data || !CheckCollisionRecs(tile, bounds[l])) continue;
+        const CompositeLayer& layer = layers[l];
+        float c = cosf(layer.rotation * DEG2RAD), s = sinf(layer.rotation * DEG2RAD);
+        float su = layer.src.width / layer.dest.width, sv = layer.src.height / layer.dest.height;
+        int nu = 1, nv = 1;
+        if (filter == COMPOSITE_AREA) {
+            nu = fminf(ceilf(fabsf(su)), COMPOSITE_MAX_SAMPLES);
+            nv = fminf(ceilf(fabsf(sv)), COMPOSITE_MAX_SAMPLES);
+        }
+        float tint[4] = {layer.tint.r / 255.f, layer.tint.g / 255.f, layer.tint.b / 255.f, layer.tint.a / 255.f};
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                float acc[4] = {0, 0, 0, 0};
+                int inside = 0;
+                for (int j = 0; j < nv; j++) {
+                    for (int i = 0; i < nu; i++) {
+                        // Into the frame of the destination rectangle, then into the source.
+                        float px = x + (i + 0.5f) / nu - layer.dest.x, py = y + (j + 0.5f) / nv - layer.dest.y;
+                        float dx = px * c + py * s, dy = -px * s + py * c;
+                        if (dx < 0 || dy < 0 || dx >= layer.dest.width || dy >= layer.dest.height) continue;
+                        float texel[4];
+                        composite_bilinear(layer.image, layer.src, layer.src.x + dx * su, layer.src.y + dy * sv, texel);
+                        for (int k = 0; k < 4; k++) acc[k] += texel[k];
+                        inside++;
+                    }
+                }
+                if (inside == 0) continue;
+                // Partly covered pixels count as partly transparent.
+                float alpha = acc[3] / (255.f * nu * nv) * tint[3];
+                uint8_t *o = pixels + ((std::size_t) y * out.width + x) * 4;
+                for (int k = 0; k < 3; k++) o[k] = roundf(acc[k] / inside * tint[k] * alpha + o[k] * (1 - alpha));
+                o[3] = roundf(255 * alpha * alpha + o[3] * (1 - alpha));
+            }
+        }
+    }
+}
+
+void
+CompositeLayers(Image& out, const std::vector<CompositeLayer>& layers, Rectangle region, Color clear, CompositeFilter filter=COMPOSITE_BILINEAR) {
+/*
+    Clears region of out (R8G8B8A8) to clear, then draws the layers over it
+    in order. Pixels outside region are left as they are.
+*/
+    assert(out.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    int x0 = fmaxf(floorf(region.x), 0), y0 = fmaxf(floorf(region.y), 0);
+    int x1 = fminf(ceilf(region.x + region.width), out.width);
+    int y1 = fminf(ceilf(region.y + region.height), out.height);
+    if (x1 <= x0 || y1 <= y0) return;
+    std::vector<Rectangle> bounds(layers.size());
+    for (std::size_t l = 0; l < layers.size(); l++) bounds[l] = CompositeLayerBounds(layers[l]);
+    int tiles_x = (x1 - x0 + COMPOSITE_TILE - 1) / COMPOSITE_TILE;
+    int tiles_y = (y1 - y0 + COMPOSITE_TILE - 1) / COMPOSITE_TILE;
+    ParallelFor(0, tiles_x * tiles_y, 1, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t t = lo; t < hi; t++) {
+            int tx0 = x0 + (t % tiles_x) * COMPOSITE_TILE, ty0 = y0 + (t / tiles_x) * COMPOSITE_TILE;
+            int tx1 = tx0 + COMPOSITE_TILE < x1 ? tx0 + COMPOSITE_TILE : x1;
+            int ty1 = ty0 + COMPOSITE_TILE < y1 ? ty0 + COMPOSITE_TILE : y1;
+            for (int y = ty0; y < ty1; y++) {
+                Color *row = (Color*) out.data + (std::size_t) y * out.width;
+                for (int x = tx0; x < tx1; x++) row[x] = clear;
+            }
+            composite_tile(out, layers, bounds, tx0, ty0, tx1, ty1, filter);
+        }
+    });
+}
+
+void
+CompositeNormalize(Image& out) {
+/*
+    Stretches every colour channel of out (R8G8B8A8) so its maximum becomes
+    255, and makes it opaque. Two parallel passes: each chunk reduces its own
+    maxima, then the merged maxima drive a lookup table per channel.
+*/
+    assert(out.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    uint8_t *pixels = (uint8_t*) out.data;
+    std::size_t n = (std::size_t) out.width * out.height;
+    std::atomic<uint32_t> maxima{0};    // One byte per channel
+    ParallelFor(0, n, 1 << 16, [&](std::size_t lo, std::size_t hi) {
+        uint8_t m[3] = {0, 0, 0};
+        for (std::size_t i = lo; i < hi; i++) {
+            for (int k = 0; k < 3; k++) m[k] = pixels[i * 4 + k] > m[k] ? pixels[i * 4 + k] : m[k];
+        }
+        uint32_t seen = maxima.load();
+        for (;;) {
+            uint32_t merged = 0;
+            for (int k = 0; k < 3; k++) {
+                uint8_t s = seen >> (8 * k);
+                merged |= (uint32_t) (m[k] > s ? m[k] : s) << (8 * k);
+            }
+            if (merged == seen || maxima.compare_exchange_weak(seen, merged)) break;
+        }
+    });
+    uint8_t lut[3][256];
+    for (int k = 0; k < 3; k++) {
+        int m = (maxima.load() >> (8 * k)) & 255;
+        for (int v = 0; v < 256; v++) lut[k][v] = m > 0 ? fminf(roundf(255.f * v / m), 255) : v;
+    }
+    ParallelFor(0, n, 1 << 16, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t i = lo; i < hi; i++) {
+            for (int k = 0; k < 3; k++) pixels[i * 4 + k] = lut[k][pixels[i * 4 + k]];
+            pixels[i * 4 + 3] = 255;
+        }
+    });
+}
+
+Rectangle
+CompositeUnion(Rectangle a, Rectangle b) {
+    // Smallest box holding both, empty boxes are ignored.
+    if (a.width <= 0 || a.height <= 0) return b;
+    if (b.width <= 0 || b.height <= 0) return a;
+    float x0 = fminf(a.x, b.x), y0 = fminf(a.y, b.y);
+    return (Rectangle) {x0, y0, fmaxf(a.x + a.width, b.x + b.width) - x0, fmaxf(a.y + a.height, b.y + b.height) - y0};
+}
@@ -27,6 +27,7 @@ float * uint8_to_float(uint8_t * img, std::size_t num_pixels, uint8_t channels_i
 
 void
 relabel_sequential(std::size_t* labels, std::size_t length, std::size_t offset = 0) {
+    PROFILE_SCOPE("relabel");
     IntPair * mapping = nullptr;
     std::size_t current_index = 0;
     for (int i = 0; i < length; i++) {
@@ -42,6 +43,7 @@ relabel_sequential(std::size_t* labels, std::size_t length, std::size_t offset =
 }
 void
 relabel_sequential_global(std::size_t** labels, std::size_t length, std::size_t offset=0) {
+    PROFILE_SCOPE("relabel");
     IntPair * mapping = nullptr;
     std::size_t current_index = 0;
     for (int j = 0; j < 3; j++) {
@@ -60,6 +62,7 @@ relabel_sequential_global(std::size_t** labels, std::size_t length, std::size_t
 
 rag
 rag_create(std::size_t n) {
+    TRACE_SCOPE("rag_create", "stage");
     rag r;
     r.num_components = n;
     r.adj_matrix  = (std::size_t*) calloc(n * n, sizeof(std::size_t));
@@ -77,6 +80,7 @@ rag_create(std::size_t n) {
 
 void
 rag_free(rag r) {
+    TRACE_SCOPE("rag_free", "stage");
     free(r.adj_matrix);
     free(r.mean_colors);
     free(r.distmat);
@@ -85,6 +89,7 @@ rag_free(rag r) {
 
 void 
 rag_adjacency_matrix(rag r, std::size_t *labels_mat, std::size_t nx, std::size_t ny) {
+    PROFILE_SCOPE("rag build");
     #define for_interval(X, MIN, MAX) for(int X = (MIN); X < (MAX); (X)++)
     std::size_t src, dst;
     std::size_t N = r.num_components;
@@ -114,43 +119,47 @@ rag_adjacency_matrix(rag r, std::size_t *labels_mat, std::size_t nx, std::size_t
 void
 rag_color_distance_matrix(rag r, float *picture, std::size_t *labels, std::size_t nx, std::size_t ny)
 {
+    PROFILE_SCOPE("rag build");
     std::size_t N = r.num_components;
     printf("Compute segments' mean color\n");
     float * mean_colors = r.mean_colors;
     float * distmat = r.distmat;
-    #pragma omp parallel for shared(mean_colors,labels,picture) firstprivate(N)
-    for (int i=0; i< N; i++) {
-        for(int k = 0; k < nx*ny; k++) {
-            if (labels[k] == i) {
-                mean_colors[i*4+0] += picture[k*3+0]; // r
-                mean_colors[i*4+1] += picture[k*3+1]; // g
-                mean_colors[i*4+2] += picture[k*3+2]; // b
-                mean_colors[i*4+3] += 1;              // area
+    ParallelFor(0, N, 1, [&](std::size_t lo, std::size_t hi) {
+        for (int i=lo; i< hi; i++) {
+            for(int k = 0; k < nx*ny; k++) {
+                if (labels[k] == i) {
+                    mean_colors[i*4+0] += picture[k*3+0]; // r
+                    mean_colors[i*4+1] += picture[k*3+1]; // g
+                    mean_colors[i*4+2] += picture[k*3+2]; // b
+                    mean_colors[i*4+3] += 1;              // area
+                }
+            }
+            float area = mean_colors[i*4+3];
+            if (area > 0) {
+                mean_colors[i*4+0] /= area; // r
+                mean_colors[i*4+1] /= area; // g
+                mean_colors[i*4+2] /= area; // b
             }
         }
-        float area = mean_colors[i*4+3];
-        if (area > 0) {
-            mean_colors[i*4+0] /= area; // r
-            mean_colors[i*4+1] /= area; // g
-            mean_colors[i*4+2] /= area; // b
-        }
-    }
+    });
     printf("Create distances matrix.\n");
-    #pragma omp parallel for shared(mean_colors, distmat) firstprivate(N)
-    for (int i=0; i< N; i++) {
-        for (int j=0; j< N; j++){
-            if (r.adj_matrix[i*N+j] > 0) {
-                distmat[i*N+j] = sqrtf(
-                    + powf(r.mean_colors[i*4+0]-r.mean_colors[j*4+0],2)
-                    + powf(r.mean_colors[i*4+1]-r.mean_colors[j*4+1],2)
-                    + powf(r.mean_colors[i*4+2]-r.mean_colors[j*4+2],2));
+    ParallelFor(0, N, 16, [&](std::size_t lo, std::size_t hi) {
+        for (int i=lo; i< hi; i++) {
+            for (int j=0; j< N; j++){
+                if (r.adj_matrix[i*N+j] > 0) {
+                    distmat[i*N+j] = sqrtf(
+                        + powf(r.mean_colors[i*4+0]-r.mean_colors[j*4+0],2)
+                        + powf(r.mean_colors[i*4+1]-r.mean_colors[j*4+1],2)
+                        + powf(r.mean_colors[i*4+2]-r.mean_colors[j*4+2],2));
+                }
             }
         }
-    }
+    });
 }
 #define for_range(X, MAX) for (int X=0; X < (MAX); X++)
 void
 rag_merge(rag r, float distance_threshold) {
+    PROFILE_SCOPE("rag merge");
     #define area(x) r.mean_colors[(x)*4+3]
     #define adj(x,y) r.adj_matrix[(x)*N+(y)]
     std::size_t N = r.num_components;
@@ -196,6 +205,7 @@ rag_merge(rag r, float distance_threshold) {
 
 void
 rag_relabel(rag r, std::size_t *labels, std::size_t num_pixels) {
+    PROFILE_SCOPE("relabel");
     for(int i = 0; i < num_pixels; i++) {
         labels[i] = r.mapping[labels[i]];
     }
@@ -23,8 +23,6 @@ typedef struct SegmentProperties {
     Rectangle bbox;
     float area;
     bool selected = false;
-    Texture2D blob_tex;
-    Image blob;
     bool operator <(const SegmentProperties& pt) const
     {
         return id < pt.id;
@@ -70,17 +68,19 @@ ImageFromImageL(std::size_t* src, Rectangle r, std::size_t nx, std::size_t ny) {
 }
 SegmentProperties
 ComputeSegmentProperties(std::size_t *labels, std::size_t nx, std::size_t ny, std::size_t label) {
-    std::size_t first_seen_x = 10000000;
-    std::size_t first_seen_y = 10000000;
+    // Centroid, area and bounding box (last pixel included) of one label, the map is scanned row by row.
+    std::size_t first_seen_x = nx;
+    std::size_t first_seen_y = ny;
     std::size_t last_seen_x  = 0;
     std::size_t last_seen_y  = 0;
     double centroid_x  = 0;
     double centroid_y  = 0;
-    float area;
+    double area = 0;
 
-    for_range(i, nx) {
-        for_range(j, ny) {
-            if (labels[j*nx+i] == label) {
+    for_range(j, ny) {
+        const std::size_t *row = labels + (std::size_t) j * nx;
+        for_range(i, nx) {
+            if (row[i] == label) {
                 centroid_x += i;
                 centroid_y += j;
                 area += 1;
@@ -91,26 +91,17 @@ ComputeSegmentProperties(std::size_t *labels, std::size_t nx, std::size_t ny, st
             }
         }
     }
-    centroid_x /= (double) area;
-    centroid_y /= (double) area;
     SegmentProperties seg;
     seg.id = label;
-    seg.bbox = (Rectangle) {(float) first_seen_x, (float)first_seen_y, (float)(last_seen_x-first_seen_x), (float)(last_seen_y-first_seen_y)};
-    seg.centroid.x = (float) centroid_x;
-    seg.centroid.y = (float) centroid_y;
     seg.area = area;
-    seg.blob = (Image) {
-        .data = ImageMaskFromImageL(labels, seg.bbox, nx, ny, label),
-        .format  = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
-        .width   = (int) seg.bbox.width,
-        .height  = (int) seg.bbox.height,
-        .mipmaps = 1,
-    };
-    ImageFormat(&seg.blob, PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA);
-    ImageColorReplace(&seg.blob, (Color) {0,0,0,255}, (Color) {0,0,0,0});
-    ImageColorReplace(&seg.blob, (Color) {255,255,255,255}, (Color) {255,255,255,128});
-    seg.blob_tex = LoadTextureFromImage(seg.blob);
-
+    if (area == 0) {
+        seg.bbox = (Rectangle) {0};
+        seg.centroid = (Vector2) {0};
+        return seg;
+    }
+    seg.bbox = (Rectangle) {(float) first_seen_x, (float)first_seen_y, (float)(last_seen_x-first_seen_x+1), (float)(last_seen_y-first_seen_y+1)};
+    seg.centroid.x = (float) (centroid_x / area);
+    seg.centroid.y = (float) (centroid_y / area);
     return seg;
 }
 
@@ -137,8 +128,24 @@ void
 opencv_nlmeans_denoising(Image input, Image& output, int strenght, int kernel_size, int search_window, int channels=4) {
     //assert(IsImageReady(input ));
     //assert(IsImageReady(output));
+    PROFILE_SCOPE("denoise");
+    // Bands of rows are denoised on the pool, OpenCV itself is single threaded (see main).
+    // A band is read with a margin of the search and template radii, so its own rows
+    // get the same result as when denoising the whole image at once.
     cv::Mat cv_input = cv::Mat(input.height, input.width, CV_8UC4, (unsigned*) input.data);
-    cv::Mat cv_output = cv_input.clone();
-    cv::fastNlMeansDenoisingColored(cv_input, cv_output, strenght, 3, kernel_size, search_window);
-    memcpy(output.data, cv_output.data, input.width*input.height*channels*sizeof(unsigned char));
+    int band = 128;
+    int margin = search_window / 2 + kernel_size / 2;
+    int num_bands = (input.height + band - 1) / band;
+    std::size_t row_bytes = (std::size_t) input.width * channels * sizeof(unsigned char);
+    ParallelFor(0, num_bands, 1, [&](std::size_t lo, std::size_t hi) {
+        for (int b = lo; b < hi; b++) {
+            int y0 = b * band, y1 = y0 + band < input.height ? y0 + band : input.height;
+            int m0 = y0 - margin > 0 ? y0 - margin : 0;
+            int m1 = y1 + margin < input.height ? y1 + margin : input.height;
+            cv::Mat cv_band = cv_input.rowRange(m0, m1).clone();
+            cv::Mat cv_output;
+            cv::fastNlMeansDenoisingColored(cv_band, cv_output, strenght, 3, kernel_size, search_window);
+            memcpy((unsigned char*) output.data + y0 * row_bytes, cv_output.ptr(y0 - m0), (y1 - y0) * row_bytes);
+        }
+    });
 }
@@ -0,0 +1,132 @@
+// Background jobs, to keep the render loop responsive during long operations.
+//
+// A job has three steps. prepare runs on the main thread when the job starts
+// and takes snapshots of its inputs, run works on those snapshots on a pool
+// worker, in the background lane, and publish runs on the main thread once the job is done, to write
+// the result back to the application (and the GPU). Jobs start in submission
+// order, but a job waits for every earlier job sharing one of its resources
+// to be published first, so it sees their results. Jobs report the fraction
+// done and poll the cancellation flag; a cancelled job is not published.
+#define JOBS_MAX_RUNNING 4
+
+struct JobProgress {
+    std::atomic<float> fraction{0.f};
+    std::atomic<bool> cancelled{false};
+};
+
+struct Job {
+    std::string name;
+    int resources = 0;         // Bit mask, jobs sharing a bit run one after the other
+    bool cancellable = true;
+    std::function<void(JobProgress&)> prepare;
+    std::function<void(JobProgress&)> run;
+    std::function<void()> publish;
+    JobProgress progress;
+    std::atomic<bool> finished{false};
+    bool started = false;
+};
+
+struct JobQueue {
+    std::vector<Job*> jobs;    // Submission order
+};
+
+Job *
+JobSubmit(JobQueue& q, std::string name, int resources, std::function<void(JobProgress&)> prepare,
+          std::function<void(JobProgress&)> run, std::function<void()> publish) {
+    Job *job = new Job();
+    job->name = name;
+    job->resources = resources;
+    job->prepare = prepare;
+    job->run = run;
+    job->publish = publish;
+    q.jobs.push_back(job);
+    return job;
+}
+
+static void
+job_start(Job *job) {
+    job->started = true;
+    if (job->prepare) job->prepare(job->progress);
+    if (job->progress.cancelled.load()) {
+        // Nothing to work on (e.g. its input is gone).
+        job->finished.store(true);
+        return;
+    }
+    PoolSubmitJob([job]() {
+        {
+            // The job may be deleted as soon as it is finished.
+            TRACE_SCOPE(job->name.c_str(), "job");
+            job->run(job->progress);
+        }
+        job->finished.store(true);
+    });
+}
+
+void
+JobsUpdate(JobQueue& q) {
+    // Main thread, once per frame: publishes finished jobs, then starts the ones that may.
+    for (std::size_t i = 0; i < q.jobs.size();) {
+        Job *job = q.jobs[i];
+        bool drop = !job->started && job->progress.cancelled.load();
+        if (job->started && job->finished.load()) {
+            if (!job->progress.cancelled.load() && job->publish) job->publish();
+            drop = true;
+        }
+        if (drop) {
+            delete job;
+            q.jobs.erase(q.jobs.begin() + i);
+        } else {
+            i++;
+        }
+    }
+    int running = 0, busy = 0;
+    for (Job *job : q.jobs) {
+        if (job->started) {
+            running++;
+        } else if (running < JOBS_MAX_RUNNING && !(job->resources & busy)) {
+            job_start(job);
+            running++;
+        }
+        busy |= job->resources;
+    }
+}
+
+void
+JobsShutdown(JobQueue& q) {
+/*
+    Cancels the jobs and waits for the running ones, nothing of theirs is
+    published. Jobs that may not be cancelled (saves) are finished instead,
+    the queued ones run here in order, once the jobs before them are done.
+*/
+    for (Job *job : q.jobs) if (job->cancellable) job->progress.cancelled.store(true);
+    for (Job *job : q.jobs) {
+        if (!job->cancellable && !job->started) {
+            fmt::print("Finishing \"{}\" before exiting.\n", job->name);
+            job->started = true;
+            if (job->prepare) job->prepare(job->progress);
+            if (!job->progress.cancelled.load()) job->run(job->progress);
+            job->finished.store(true);
+        }
+        while (job->started && !job->finished.load()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (!job->cancellable && !job->progress.cancelled.load() && job->publish) job->publish();
+        delete job;
+    }
+    q.jobs.clear();
+}
+
+Rectangle
+GuiJobs(JobQueue& q, float x, float y) {
+    // One progress bar per job with a cancel button, returns the area used.
+    float width = 300, row = 22;
+    for (std::size_t i = 0; i < q.jobs.size(); i++) {
+        Job *job = q.jobs[i];
+        Rectangle bar = {x, y + i * row, width - row, row - 2};
+        const char *state = job->progress.cancelled.load() ? "cancelling" : (job->started ? "" : "queued");
+        GuiProgressBar(bar, NULL, NULL, job->progress.fraction.load(), 0.f, 1.f);
+        GuiLabel((Rectangle) {bar.x + 5, bar.y, bar.width - 10, bar.height}, TextFormat("%s %s", job->name.c_str(), state));
+        if (job->cancellable && GuiButton((Rectangle) {x + width - row, bar.y, row - 2, row - 2}, GuiIconText(ICON_CROSS_SMALL, NULL))) {
+            job->progress.cancelled.store(true);
+        }
+    }
+    return (Rectangle) {x, y, width, q.jobs.size() * row};
+}
@@ -0,0 +1,145 @@
+// Connected-components labelling on label maps.
+//
+// Block-based union-find: the image is cut in horizontal strips that are
+// labelled independently, then the strips are stitched along their first row.
+// Union always links the larger root under the smaller one, so every root is
+// the smallest pixel index of its component (i.e. the first one met in raster
+// order). The first component of a label keeps its id, the others get fresh
+// ids starting at next_label, optionally reporting which label each one came
+// from so that the split can be undone.
+#define CC_STRIP_HEIGHT 64
+
+template<typename Index>
+static inline Index
+cc_find(Index *parent, Index i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]]; // path halving
+        i = parent[i];
+    }
+    return i;
+}
+
+template<typename Index>
+static inline Index
+cc_root(const Index *parent, Index i) {
+    // Read-only find, safe to call concurrently once the forest is built.
+    while (parent[i] != i) i = parent[i];
+    return i;
+}
+
+template<typename Index>
+static inline void
+cc_union(Index *parent, Index a, Index b) {
+    a = cc_find(parent, a);
+    b = cc_find(parent, b);
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+}
+
+template<typename Index>
+static inline void
+cc_link_rows(Index *parent, const std::size_t *labels, std::size_t nx, std::size_t y, bool diagonals) {
+    // Union every pixel of row y with its neighbours in row y-1.
+    for (std::size_t x = 0; x < nx; x++) {
+        Index i = y * nx + x;
+        std::size_t l = labels[i];
+        if (labels[i-nx] == l) cc_union<Index>(parent, i, i-nx);
+        if (diagonals) {
+            if (x > 0    && labels[i-nx-1] == l) cc_union<Index>(parent, i, i-nx-1);
+            if (x < nx-1 && labels[i-nx+1] == l) cc_union<Index>(parent, i, i-nx+1);
+        }
+    }
+}
+
+template<typename Index>
+std::size_t
+split_disconnected_labels_impl(std::size_t *labels, std::size_t nx, std::size_t ny, std::size_t next_label, int connectivity, std::vector<std::size_t> *origins) {
+    std::size_t length = nx * ny;
+    bool diagonals = connectivity == 8;
+    int num_strips = (ny + CC_STRIP_HEIGHT - 1) / CC_STRIP_HEIGHT;
+    Index *parent = (Index*) malloc(length * sizeof(Index));
+    assert(parent);
+
+    // Local labelling, each strip only touches its own pixels.
+    ParallelFor(0, num_strips, 1, [&](std::size_t lo, std::size_t hi) {
+        for (int s = lo; s < hi; s++) {
+            std::size_t y0 = s * CC_STRIP_HEIGHT;
+            std::size_t y1 = y0 + CC_STRIP_HEIGHT < ny ? y0 + CC_STRIP_HEIGHT : ny;
+            for (std::size_t i = y0 * nx; i < y1 * nx; i++) parent[i] = i;
+            for (std::size_t y = y0; y < y1; y++) {
+                if (y > y0) cc_link_rows<Index>(parent, labels, nx, y, diagonals);
+                for (std::size_t x = 1; x < nx; x++) {
+                    Index i = y * nx + x;
+                    if (labels[i-1] == labels[i]) cc_union<Index>(parent, i, i-1);
+                }
+            }
+            // parent[i] <= i, so one raster pass points every pixel at its root.
+            for (std::size_t i = y0 * nx; i < y1 * nx; i++) parent[i] = parent[parent[i]];
+        }
+    });
+
+    // Stitch the strips, only strip roots are rewritten here.
+    for (int s = 1; s < num_strips; s++) {
+        cc_link_rows<Index>(parent, labels, nx, s * CC_STRIP_HEIGHT, diagonals);
+    }
+
+    // Roots in raster order: the first root of a label keeps it.
+    std::vector<std::vector<Index>> roots(num_strips);
+    ParallelFor(0, num_strips, 1, [&](std::size_t lo, std::size_t hi) {
+        for (int s = lo; s < hi; s++) {
+            std::size_t start = s * CC_STRIP_HEIGHT * nx;
+            std::size_t stop  = start + CC_STRIP_HEIGHT * nx < length ? start + CC_STRIP_HEIGHT * nx : length;
+            for (std::size_t i = start; i < stop; i++) {
+                if (parent[i] == i) roots[s].push_back(i);
+            }
+        }
+    });
+    IntPair *seen = nullptr;
+    std::size_t first_new = next_label;
+    for (auto & strip_roots : roots) {
+        for (Index r : strip_roots) {
+            if (hmgeti(seen, labels[r]) < 0) {
+                hmput(seen, labels[r], 1);
+                continue;
+            }
+            if (origins) origins->push_back(labels[r]);
+            labels[r] = next_label++;
+        }
+    }
+    hmfree(seen);
+
+    if (next_label != first_new) {
+        // Roots are not rewritten in this pass, so reading them is race-free.
+        ParallelFor(0, length, 1 << 16, [&](std::size_t lo, std::size_t hi) {
+            for (std::size_t i = lo; i < hi; i++) {
+                if (parent[i] != i) labels[i] = labels[cc_root<Index>(parent, parent[i])];
+            }
+        });
+    }
+    free(parent);
+    return next_label;
+}
+
+std::size_t
+split_disconnected_labels(std::size_t *labels, std::size_t nx, std::size_t ny, std::size_t next_label, int connectivity=4, std::vector<std::size_t> *origins=nullptr) {
+/*
+    Gives a fresh label to every extra connected component of a label.
+
+    Parameters
+    ----------
+    labels : (ny, nx) label map, relabelled in place.
+    next_label : first label id free for allocation.
+    connectivity : 4 or 8 neighbours.
+    origins : if given, receives the former label of each new one, in order.
+
+    Returns
+    -------
+    The next free label after the allocation.
+*/
+    assert(connectivity == 4 || connectivity == 8);
+    if (nx * ny == 0) return next_label;
+    // 32-bit parents halve the memory traffic whenever the image allows it.
+    if (nx * ny < UINT32_MAX)
+        return split_disconnected_labels_impl<uint32_t>(labels, nx, ny, next_label, connectivity, origins);
+    return split_disconnected_labels_impl<std::size_t>(labels, nx, ny, next_label, connectivity, origins);
+}
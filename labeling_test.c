@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <algorithm>
+#define STB_DS_IMPLEMENTATION
+#include "stb_ds.h"
+#include "trace.h"
+#include "pool.h"
+
+struct IntPair {                    // As in graphs.h, which needs raylib
+    std::size_t key, value;
+};
+
+#include "labeling.h"
+
+static std::size_t
+flood_fill_split(std::size_t *labels, std::size_t nx, std::size_t ny, std::size_t next_label, int connectivity, std::vector<std::size_t>& origins) {
+    // Reference: components met in raster order, the first one of a label keeps it.
+    std::vector<std::size_t> before(labels, labels + nx * ny);
+    std::vector<bool> visited(nx * ny, false);
+    std::vector<std::size_t> stack;
+    std::vector<std::size_t> seen;
+    for (std::size_t start = 0; start < nx * ny; start++) {
+        if (visited[start]) continue;
+        std::size_t l = before[start], value = l;
+        if (std::find(seen.begin(), seen.end(), l) == seen.end()) {
+            seen.push_back(l);
+        } else {
+            origins.push_back(l);
+            value = next_label++;
+        }
+        stack.push_back(start);
+        visited[start] = true;
+        while (!stack.empty()) {
+            std::size_t i = stack.back();
+            stack.pop_back();
+            labels[i] = value;
+            long x = i % nx, y = i / nx;
+            for (long dy = -1; dy <= 1; dy++) {
+                for (long dx = -1; dx <= 1; dx++) {
+                    if ((dx == 0 && dy == 0) || (connectivity == 4 && dx != 0 && dy != 0)) continue;
+                    if (x + dx < 0 || x + dx >= (long) nx || y + dy < 0 || y + dy >= (long) ny) continue;
+                    std::size_t j = (y + dy) * nx + x + dx;
+                    if (!visited[j] && before[j] == l) {
+                        visited[j] = true;
+                        stack.push_back(j);
+                    }
+                }
+            }
+        }
+    }
+    return next_label;
+}
+
+static void
+check_split(const std::vector<std::size_t>& labels, std::size_t nx, std::size_t ny, int connectivity) {
+    std::size_t next_label = 1000;
+    std::vector<std::size_t> got = labels, expected = labels, origins, expected_origins;
+    std::size_t got_next = split_disconnected_labels(got.data(), nx, ny, next_label, connectivity, &origins);
+    std::size_t expected_next = flood_fill_split(expected.data(), nx, ny, next_label, connectivity, expected_origins);
+    assert(got_next == expected_next);
+    assert(got == expected);
+    assert(origins == expected_origins);
+    // Undo data: piece next_label + k was cut out of label origins[k].
+    for (std::size_t i = 0; i < nx * ny; i++) {
+        if (got[i] >= next_label) assert(origins[got[i] - next_label] == labels[i]);
+        else assert(got[i] == labels[i]);
+    }
+}
+
+int main(int argc, char** argv) {
+    std::mt19937 rng(3);
+    // Taller than a few strips, heights not a multiple of CC_STRIP_HEIGHT.
+    std::size_t sizes[][2] = {{1, 3 * CC_STRIP_HEIGHT}, {97, 5 * CC_STRIP_HEIGHT + 17}, {256, 4 * CC_STRIP_HEIGHT}, {3, 2}};
+    for (auto & size : sizes) {
+        std::size_t nx = size[0], ny = size[1];
+        std::vector<std::size_t> labels(nx * ny);
+        for (int connectivity : {4, 8}) {
+            // Noise of a few labels, many small pieces and diagonal contacts.
+            for (auto & l : labels) l = rng() % 3;
+            check_split(labels, nx, ny, connectivity);
+            // Blobs, pieces spread over several strips.
+            for (std::size_t y = 0; y < ny; y++) {
+                for (std::size_t x = 0; x < nx; x++) labels[y * nx + x] = ((x / 7) * 3 + (y / 23) * 5 + (rng() % 50 == 0)) % 4;
+            }
+            check_split(labels, nx, ny, connectivity);
+            // A comb: teeth of one label only joined by the last row, across every strip seam.
+            for (std::size_t y = 0; y < ny; y++) {
+                for (std::size_t x = 0; x < nx; x++) labels[y * nx + x] = y == ny - 1 || x % 2 == 0 ? 1 : 2 + x;
+            }
+            check_split(labels, nx, ny, connectivity);
+            // A checkerboard, one piece with diagonals, every pixel its own piece without.
+            for (std::size_t i = 0; i < nx * ny; i++) labels[i] = (i % nx + i / nx) % 2;
+            check_split(labels, nx, ny, connectivity);
+        }
+    }
+    printf("labeling_test passed\n");
+    return 0;
+}
@@ -5,6 +5,22 @@
 #include <nlohmann/json.hpp>
 #include <opencv2/opencv.hpp>
 #include <set>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <array>
+#include <cerrno>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 #include "raylib.h"
@@ -14,12 +30,28 @@
 #define GUI_FILE_DIALOG_IMPLEMENTATION
 #include "gui_file_dialog.h"
 
+#include "trace.h"
+#include "profiler.h"
+#include "pool.h"
+#include "jobs.h"
 #include "quickshift.h"
 #define STB_DS_IMPLEMENTATION
 #include "stb_ds.h"
 #include "graphs.h"
 #include "img_manipulation.h"
 #include "core.h"
+#include "labeling.h"
+#include "phimap_stats.h"
+#include "tile_pyramid.h"
+#include "strokes.h"
+#include "patch_grid.h"
+#include "atlas.h"
+#include "boundaries.h"
+#include "selection.h"
+#include "compositor.h"
+#include "tile_export.h"
+#include "registration.h"
+#include "project_file.h"
 
 #define STITCH_GUI_TICK_HEIGHT 0.05f
 #define STITCH_GUI_TICK_THICKNESS  0.02f
@@ -47,27 +79,6 @@ struct AdvancedWindowState {
     const char *title;
     bool dragged = false;
 };
-Image MarkBoundaries(Image background, std::size_t* segmentation, Color color) {
-  int width = background.width;
-  int height = background.height;
-  Image marked_bg = ImageCopy(background);
-  #define seg_at(x, y) (((std::size_t*)segmentation)[(x)*width+(y)])
-  #define bg_at(x, y) (((Color*)marked_bg.data)+(x)*width+(y))
-  #pragma omp parallel for shared(background, segmentation, marked_bg) firstprivate(height,width)
-  for (int i = 1; i < height-1; i ++){
-        for (int j = 1; j < width-1; j ++) {
-          bool boundary = seg_at(i, j) != seg_at(i, j+1);
-          boundary |= seg_at(i, j-1) != seg_at(i, j);
-          boundary |= seg_at(i+1, j) != seg_at(i, j);
-          boundary |= seg_at(i-1, j) != seg_at(i, j);
-          *bg_at(i,j) = boundary ? color : *bg_at(i,j);
-        }
-  }
-  #undef seg_at
-  #undef bg_at
-  return marked_bg;
-}
-
 bool 
 GuiAdvancedWindow(AdvancedWindowState *state) {
     if(state->windowOpened) {
@@ -94,7 +105,7 @@ GuiAdvancedWindow(AdvancedWindowState *state) {
 }
 
 struct PhiMap {
-  PhiMap(float _x, float _y, float _w, float _h, int _r, Texture2D _tex, bool _s, bool _mb, int _fn) {
+  PhiMap(float _x, float _y, float _w, float _h, float _r, Texture2D _tex, bool _s, bool _mb, int _fn) {
     x = _x;
     y = _y;
     w = _w;
@@ -108,7 +119,14 @@ struct PhiMap {
   float x, y;
   float w, h;
   float rotation_deg;
-  Texture2D tex;
+  Texture2D tex;                  // Atlas page, or own texture when too large
+  Rectangle src = {0};            // Patch pixels inside tex
+  bool in_atlas = false;
+  Image image = {0};              // Pixels kept on the CPU; backgrounds are
+  TilePyramid *pyramid = nullptr; // drawn tile by tile from them.
+  Image gray = {0};               // Backgrounds: grayscale RGBA copy for the compound background, made on demand
+  float registration_score = NAN; // Patches: score of the last automatic registration [a]
+  float alignment_score = NAN;    // Backgrounds: correlation of the last alignment [e]
   bool selected = false;
   bool mouse_bound = false;
   Vector2 relmousepos;
@@ -130,7 +148,7 @@ struct PhiMap {
   }
 };
 
-Rectangle GetPhiMapRectangle(PhiMap im, float scale) {
+Rectangle GetPhiMapRectangle(const PhiMap& im, float scale) {
   Rectangle ret = {(float)im.x, (float)im.y, (float)im.w, (float)im.h};
   if (scale != 0.0) {
     ret.width *= 2 * scale;
@@ -139,26 +157,114 @@ Rectangle GetPhiMapRectangle(PhiMap im, float scale) {
   return ret; 
 } 
 
-PhiMap LoadPhiMap(const char* filename, int id, float pos=0, std::string folder="new_pngs") {
+Rectangle GetPhiMapBounds(const PhiMap& im, float scale, float angle) {
+  // Covers the patch both as drawn (rotated around its corner) and as picked (axis aligned).
+  Rectangle r = GetPhiMapRectangle(im, scale);
+  float c = cosf(angle * DEG2RAD), s = sinf(angle * DEG2RAD);
+  float x0 = r.x, y0 = r.y, x1 = r.x + r.width, y1 = r.y + r.height;
+  Vector2 corners[3] = {{r.width, 0}, {0, r.height}, {r.width, r.height}};
+  for (auto & v : corners) {
+    float x = r.x + v.x * c - v.y * s, y = r.y + v.x * s + v.y * c;
+    x0 = fmin(x0, x); y0 = fmin(y0, y);
+    x1 = fmax(x1, x); y1 = fmax(y1, y);
+  }
+  return (Rectangle) {x0, y0, x1 - x0, y1 - y0};
+}
+
+void LoadPhiMapTexture(PhiMap& im, Image cat, Atlas& atlas) {
+  // Packed into the atlas when it fits, own texture otherwise.
+  im.in_atlas = AtlasAdd(atlas, cat, im.tex, im.src);
+  if (!im.in_atlas) {
+    im.tex = LoadTextureFromImage(cat);
+    im.src = (Rectangle) {0.f, 0.f, (float) cat.width, (float) cat.height};
+  }
+}
+void UnloadPhiMapTexture(PhiMap& im) {
+  if (!im.in_atlas) UnloadTexture(im.tex);
+  im.tex = (Texture2D) {0};
+}
+void UnloadPatch(PhiMap& im) {
+  UnloadPhiMapTexture(im);
+  if (im.image.data) UnloadImage(im.image);
+  im.image = (Image) {0};
+}
+PhiMap LoadPhiMap(const char* filename, int id, Atlas& atlas, float pos=0, std::string folder="new_pngs") {
   fmt::print("Importing : {} to id {}\n", filename, id);
   Image cat = LoadImage(filename);
   ExportImage(cat, fmt::format("{}/{}.png", folder, id).c_str());
   ImageFlipHorizontal(&cat);
   ImageFlipVertical(&cat);
-  Texture2D texture = LoadTextureFromImage(cat);      
-  UnloadImage(cat);
+  ImageFormat(&cat, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
   // Load 5% app.images (convention) with 100 dpi
-  return (PhiMap) { pos*2, -1, texture.width / 100.f * 0.05f, texture.height/100.f*0.05f, 0, texture, false, false, id};
+  PhiMap im = (PhiMap) { pos*2, -1, cat.width / 100.f * 0.05f, cat.height/100.f*0.05f, 0, (Texture2D) {0}, false, false, id};
+  LoadPhiMapTexture(im, cat, atlas);
+  im.image = cat; // Kept for the compositor
+  return im;
 }
-PhiMap LoadPhiMapJSON(const char* filename, json d, int id) {
+Image LoadPhiMapImage(const char* filename) {
+  TRACE_SCOPE("load png", "io");
   Image cat = LoadImage(filename);
   ImageFlipHorizontal(&cat);
   ImageFlipVertical(&cat);
-  Texture2D texture = LoadTextureFromImage(cat);      
-  UnloadImage(cat);
-  return (PhiMap) {d["x"], d["y"], d["w"], d["h"], d["r"], texture, false, false, id};
+  ImageFormat(&cat, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  return cat;
+}
+PhiMap LoadPhiMapJSON(Image cat, json d, int id, Atlas& atlas) {
+  PhiMap im = (PhiMap) {d["x"], d["y"], d["w"], d["h"], d["r"], (Texture2D) {0}, false, false, id};
+  LoadPhiMapTexture(im, cat, atlas);
+  im.image = cat; // Kept for the compositor
+  return im;
+}
+Image LoadBackgroundImage(const char* filename) {
+  TRACE_SCOPE("load png", "io");
+  Image bg = LoadImage(filename);
+  ImageFormat(&bg, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  return bg;
 }
+PhiMap LoadBackground(Image bg, const char* filename, float x, float y, float w, float h, float r) {
+  // No texture: backgrounds may exceed the GPU texture size limit.
+  PhiMap ret = PhiMap(x, y, w, h, r, (Texture2D) {0}, false, false, 0);
+  ret.image = bg;
+  ret.pyramid = TilePyramidCreate(bg);
+  ret.filename = filename;
+  int count = 0;
+  const char ** extension = TextSplit(GetFileName(filename), '.', &count);
+  ret.type = fmt::format("{}", extension[1]);
+  return ret;
+}
+
 
+#define LABEL_UNDO_DEPTH 32
+
+struct LabelUndo {
+  // Reverts a sparse edit: the former label of every changed pixel,
+  // and the label every piece split off afterwards was taken from.
+  int segmentation;
+  std::vector<std::size_t> pixels;
+  std::vector<std::size_t> labels;
+  std::size_t split_first = 0;
+  std::vector<std::size_t> split_from;
+  Rectangle bbox = {0};
+};
+
+// Data the background jobs read or write, see JobSubmit.
+enum JobResource { JOB_STEPS = 1, JOB_LABELS = 2, JOB_PHIMAP = 4, JOB_PROJECT = 8, JOB_ALL = 15 };
+
+// The phimap, while it is the patch composite [p], follows the patches.
+struct LivePhimap {
+  bool active = false;
+  int base = 0;                       // Segmentation base it covers
+  std::vector<Rectangle> footprints;  // Bounds of each patch layer, in phimap pixels
+};
+
+// A project file and what it holds, so saving to it again only writes what changed.
+struct SavedLayers {
+  std::string bin;
+  uint32_t versions[5] = {0};         // Of each layer, see ApplicationState::layer_versions
+  std::string json;                   // Project state written with them
+};
+
+#define AUTOSAVE_SECONDS 120
 
 enum AppMode { Stitching, Segmenting };
 enum CursorMode { Brush, Eraser };
@@ -167,7 +273,10 @@ struct ApplicationState {
     int file_loaded = 0;
 
     std::vector<PhiMap> images;
+    Atlas atlas;
     std::vector<PhiMap> backgrounds;
+    PatchGrid patch_grid;
+    std::vector<int> patches_found;
     float * backgrounds_alpha = nullptr;
     float global_scale = 0.5;
     float global_angle = 0.5;
@@ -178,16 +287,25 @@ struct ApplicationState {
     int  segmentation_base = 0;
     int shown_step = 0;
     bool steps_initialized = false;
-    Image steps[5];
+    Image steps[2];
     bool use_phi = false;
     bool show_segmentation = true;
-    Texture2D steps_tex[5];
+    TilePyramid *steps_pyr[2] = {nullptr, nullptr}; // Made when the step is first shown, see StepPyramid
+    ProjectMapping steps_mapping;                    // Project file the steps may point into
+    TilePyramid *phimap_pyr = nullptr;
+    BoundaryLayer boundaries[3];
     std::size_t* segmentations[3] = {nullptr, nullptr, nullptr};
     Color boundaries_color = RED;
     Color focus_zone_color = PINK;
     bool gui_toggle_active = false;
     int focus_zone_state = 0;
-    bool boundaries_dirty = false;
+    Rectangle labels_dirty[3] = {{0}, {0}, {0}};
+    uint32_t layer_versions[5] = {0};               // STEP0, STEP1, LABELS0 to 2, bumped on every change
+    EncodedLabels labels_encoded[3];                 // Shared with the save snapshots
+    std::string project_name;                        // Last .json opened or saved, empty for a new project
+    SavedLayers saved, autosaved;
+    double autosave_time = 0;
+    bool autosave_pending = false;
     bool hovering_menus = false;
     float phimaps_alpha = 0.5;
     Rectangle focus_zone = (Rectangle) {1,1, 5, 5};
@@ -203,13 +321,19 @@ struct ApplicationState {
     
     SegmentPropertiesKM * metadata_labels = nullptr;
     SegmentSelection * selected_labels = nullptr;
+    SelectionLayer selection;
 
-    Image drawing_board = {0};
+    StrokeLayer strokes;
     Image phimap = {0};
+    LivePhimap phimap_live;
+    Image phimap_smoothed = {0};
     bool drawing_board_active = false;
     Vector2 drawing_board_cursor;
     float drawing_board_cursor_size = 3;
-    Texture2D drawing_board_tex = {0};
+    StrokeEngine stroke;
+    std::vector<LabelUndo> label_undo;
+    JobQueue jobs;
+    Rectangle jobs_rect = {0};
     int drawing_board_cursor_mode = CursorMode::Brush;
 
     struct Parameters {
@@ -242,7 +366,7 @@ DrawFocusZone(ApplicationState app, Camera2D camera) {
   }
 }
 
-std::size_t current_max_label(ApplicationState app, int avoid=-1) {
+std::size_t current_max_label(ApplicationState& app, int avoid=-1) {
   Image& start = app.steps[0];
   std::size_t current_max = 0;
   for (int i = 0; i < 3; i++) {
@@ -253,29 +377,289 @@ std::size_t current_max_label(ApplicationState app, int avoid=-1) {
 }
 
 void
-EnsureWellAllocatedSegments(ApplicationState& app) {
+UpdatePatchGrid(ApplicationState& app) {
+  // The bounds follow the global transform, which changes them all at once.
+  PatchGrid& grid = app.patch_grid;
+  if (grid.scale == app.global_scale && grid.angle == app.global_angle && grid.bounds.size() == app.images.size()) return;
+  std::vector<Rectangle> bounds(app.images.size());
+  for (int i = 0; i < app.images.size(); i++) bounds[i] = GetPhiMapBounds(app.images[i], app.global_scale, app.global_angle);
+  PatchGridBuild(grid, bounds, app.global_scale, app.global_angle);
+}
+
+void
+MarkLabelsChanged(ApplicationState & app, int segmentation, Rectangle pixels) {
+  // For saving: a new version of the layer, and its encoded strips under pixels are stale.
+  app.layer_versions[2 + segmentation]++;
+  int w = app.steps[0].width, h = app.steps[0].height;
+  int x0 = fmax(floorf(pixels.x), 0), y0 = fmax(floorf(pixels.y), 0);
+  int x1 = fmin(ceilf(pixels.x + pixels.width), w), y1 = fmin(ceilf(pixels.y + pixels.height), h);
+  if (x1 <= x0 || y1 <= y0) return;
+  EncodedLabelsInvalidate(app.labels_encoded[segmentation], (uint64_t) y0 * w + x0, (uint64_t) (y1 - 1) * w + x1);
+}
+
+void
+SplitDisconnectedSegments(ApplicationState& app, int segmentation, LabelUndo *undo=nullptr) {
+  // Merges and brush edits may leave one label on several blobs,
+  // the extra pieces get fresh ids above every segmentation's maximum.
+  Image& start = app.steps[0];
+  std::size_t next_label = current_max_label(app) + 1;
+  std::vector<std::size_t> *origins = undo ? &undo->split_from : nullptr;
+  if (undo) undo->split_first = next_label;
+  std::size_t split = split_disconnected_labels(app.segmentations[segmentation], start.width, start.height, next_label, 4, origins) - next_label;
+  if (split > 0) fmt::print("Split {} disconnected pieces in segmentation {}\n", split, segmentation);
+  // The pieces may lie anywhere, but their boundaries are unchanged.
+  if (split > 0) MarkLabelsChanged(app, segmentation, {0, 0, (float) start.width, (float) start.height});
+}
+
+void
+EnsureWellAllocatedSegments(ApplicationState& app) {
   Image& start = app.steps[0];
   std::size_t length = start.width * start.height;
-  for_range(i, 3) {
+  for_range(i, 3) {
     if (!app.segmentations[i]) 
     {
       fmt::print("Allocating {} size_t for semgentation {}\n", length, i);
       app.segmentations[i] = (std::size_t*) calloc(length, sizeof(std::size_t));
+      MarkLabelsChanged(app, i, {0, 0, (float) start.width, (float) start.height});
     }
   }
 }
 
 void
-LoadAll(char* filename, ApplicationState & app) {
+ClearSelection(ApplicationState & app) {
+  // Drops the selection and the cached segment properties, the labels may have changed.
+  SelectionLayerClear(app.selection);
+  hmfree(app.metadata_labels);
+  hmfree(app.selected_labels);
+}
+
+void
+MarkLabelsDirty(ApplicationState & app, int segmentation, Rectangle pixels) {
+  // Grows the region of the segmentation whose display must be refreshed.
+  MarkLabelsChanged(app, segmentation, pixels);
+  Rectangle& dirty = app.labels_dirty[segmentation];
+  if (dirty.width <= 0 || dirty.height <= 0) {
+    dirty = pixels;
+    return;
+  }
+  float x1 = fmax(dirty.x + dirty.width, pixels.x + pixels.width);
+  float y1 = fmax(dirty.y + dirty.height, pixels.y + pixels.height);
+  dirty.x = fmin(dirty.x, pixels.x);
+  dirty.y = fmin(dirty.y, pixels.y);
+  dirty.width = x1 - dirty.x;
+  dirty.height = y1 - dirty.y;
+}
+
+void
+PushLabelUndo(ApplicationState & app, LabelUndo& undo) {
+  if (undo.pixels.empty()) return;
+  if (app.label_undo.size() >= LABEL_UNDO_DEPTH) app.label_undo.erase(app.label_undo.begin());
+  app.label_undo.push_back(std::move(undo));
+}
+
+void
+UndoLabelEdit(ApplicationState & app) {
+  LabelUndo& undo = app.label_undo.back();
+  Image& start = app.steps[0];
+  std::size_t *labels = app.segmentations[undo.segmentation];
+  if (!undo.split_from.empty()) {
+    // Split pieces may lie anywhere, they take their former label back first.
+    std::size_t length = start.width*start.height;
+    std::size_t split_last = undo.split_first + undo.split_from.size();
+    ParallelFor(0, length, 1 << 16, [&](std::size_t lo, std::size_t hi) {
+      for (std::size_t i = lo; i < hi; i++) {
+        if (labels[i] >= undo.split_first && labels[i] < split_last) labels[i] = undo.split_from[labels[i] - undo.split_first];
+      }
+    });
+    MarkLabelsDirty(app, undo.segmentation, {0, 0, (float) start.width, (float) start.height});
+  }
+  for (std::size_t k = 0; k < undo.pixels.size(); k++) labels[undo.pixels[k]] = undo.labels[k];
+  MarkLabelsDirty(app, undo.segmentation, undo.bbox);
+  app.label_undo.pop_back();
+}
+
+struct ProjectData {
+  // Everything a project file brings, read off the main thread.
+  json data;
+  std::vector<Image> patches;
+  std::vector<Image> backgrounds;
+  Image steps[2] = {{0}, {0}};
+  std::size_t *segmentations[3] = {nullptr, nullptr, nullptr};
+  ProjectMapping mapping;                   // The steps may be views into it
+  std::string source;                       // The chunked file the layers came from, if any
+  ~ProjectData() {
+    for (auto & im : patches) if (im.data) UnloadImage(im);
+    for (auto & im : backgrounds) if (im.data) UnloadImage(im);
+    for (auto & im : steps) if (im.data && !ProjectMappingOwns(mapping, im.data)) UnloadImage(im);
+    for (auto seg : segmentations) free(seg);
+    ProjectFileUnmap(mapping);
+  }
+};
+
+void
+ReadProjectLegacy(const char *bin_filename, ProjectData& project) {
+  // Files written before project_file.h: a size_t header, then every layer back to back.
+  FILE *read_ptr;
+  std::size_t buffer_len;
+  read_ptr = fopen(bin_filename,"rb");
+  if (read_ptr)
+  {
+    TRACE_SCOPE("read bin", "io");
+    // The header and the sizes it gives are checked against the file before trusting them.
+    struct stat st;
+    bool ok = fstat(fileno(read_ptr), &st) == 0 && fread(&buffer_len, sizeof(std::size_t), 1, read_ptr) == 1
+              && buffer_len >= 4*sizeof(std::size_t) && buffer_len <= (std::size_t) st.st_size;
+    uint8_t *start = ok ? (uint8_t*) malloc(buffer_len) : nullptr;
+    ok = start && fread(start, buffer_len-sizeof(std::size_t), 1, read_ptr) == 1;
+    std::size_t *buffer_as_sizet = (std::size_t*)start;
+    std::size_t width = ok ? buffer_as_sizet[0] : 0;
+    std::size_t height = ok ? buffer_as_sizet[1] : 0;
+    std::size_t format = ok ? buffer_as_sizet[2] : 0;
+    uint8_t *buffer = (uint8_t*) (buffer_as_sizet+3);
+    std::size_t imlength = width*height;
+    // Five RGBA images and three label maps after the three sizes.
+    ok = ok && width > 0 && height > 0 && height <= buffer_len / width
+         && 3*sizeof(std::size_t) + imlength*(5*4 + 3*sizeof(std::size_t)) <= buffer_len - sizeof(std::size_t);
+    if (!ok) {
+      fmt::print("{} is not a project file, only the images are loaded.\n", bin_filename);
+      free(start);
+      fclose(read_ptr);
+      return;
+    }
+    printf("Loading %lu x %lu images for a total of %lu bytes.\n\f", width, height, buffer_len);
+    assert(buffer_len > 0);
+    for_range(i, 5) {
+      // Steps 2 to 4 are boundary previews, rebuilt from the segmentations.
+      if (i < 2) {
+        project.steps[i].data = (uint8_t*) malloc(imlength*4*sizeof(uint8_t));
+        project.steps[i].height = height;
+        project.steps[i].width = width;
+        project.steps[i].mipmaps = 1;
+        project.steps[i].format = format;
+        memcpy(project.steps[i].data, buffer, imlength*4*sizeof(uint8_t));
+      }
+      buffer += imlength*4*sizeof(uint8_t);
+    }
+    // Segmentations
+    for_range(i, 3) {
+      project.segmentations[i] = (std::size_t*) malloc(imlength*sizeof(std::size_t));
+      memcpy(project.segmentations[i], buffer, imlength*sizeof(std::size_t));
+      buffer += imlength*sizeof(std::size_t);
+    }
+    free(start);
+    fclose(read_ptr);
+  }
+}
+
+void
+ReadProjectLayers(const char *bin_filename, ProjectFile& pf, ProjectData& project, JobProgress& progress) {
+/*
+    Chunked files: the two step images are views into the mapped file, read
+    only when their pages are touched; the three label maps are decoded in
+    place.
+*/
+  static_assert(sizeof(std::size_t) == sizeof(uint64_t), "labels are stored as 64-bit");
+  TRACE_SCOPE("read bin", "io");
+  const ChunkInfo *steps[2] = {ProjectFileFind(pf, "STEP0"), ProjectFileFind(pf, "STEP1")};
+  const ChunkInfo *labels[3] = {ProjectFileFind(pf, "LABELS0"), ProjectFileFind(pf, "LABELS1"), ProjectFileFind(pf, "LABELS2")};
+  if (!steps[0] || !steps[1] || !labels[0] || !labels[1] || !labels[2]) {
+    fmt::print("Project layers missing, only the images are loaded.\n");
+    return;
+  }
+  bool ok = true;
+  if (!ProjectFileMap(bin_filename, project.mapping)) fmt::print("Could not map {}, reading it.\n", bin_filename);
+  for_range(i, 2) {
+    const ChunkInfo& c = *steps[i];
+    void *view = ProjectFileView(project.mapping, c);
+    project.steps[i] = (Image) {view ? view : malloc(c.raw_size), (int) c.width, (int) c.height, 1, (int) c.format};
+    ok = ok && project.steps[i].data && c.raw_size == (uint64_t) c.width * c.height * 4 && (view || ProjectFileReadChunk(pf, c, project.steps[i].data));
+  }
+  for_range(i, 3) {
+    const ChunkInfo& c = *labels[i];
+    project.segmentations[i] = (std::size_t*) malloc(c.raw_size);
+    ok = ok && project.segmentations[i] && c.raw_size == (uint64_t) steps[0]->width * steps[0]->height * sizeof(std::size_t)
+         && ProjectFileReadChunk(pf, c, project.segmentations[i]);
+  }
+  if (ok) {
+    project.source = bin_filename;
+    return;
+  }
+  // A damaged layer would load as garbage, keep none of them.
+  fmt::print("Project layers are damaged (checksum or size mismatch), only the images are loaded.\n");
+  for_range(i, 2) {
+    if (project.steps[i].data && !ProjectMappingOwns(project.mapping, project.steps[i].data)) UnloadImage(project.steps[i]);
+    project.steps[i] = (Image) {0};
+  }
+  ProjectFileUnmap(project.mapping);
+  for_range(i, 3) {
+    free(project.segmentations[i]);
+    project.segmentations[i] = nullptr;
+  }
+}
+
+void
+ReadProject(std::string filename, ProjectData& project, JobProgress& progress, bool read_data=true) {
+  PROFILE_SCOPE("load");
   fmt::print("Loading {}.\n", filename);
   std::ifstream f(filename);
-  json data = json::parse(f); 
+  json& data = project.data;
+  data = json::parse(f); 
+  std::string folder = data["global"]["folder"];
+  float total = data["patches"].size() + data["backgrounds"].size() + 1;
+  for (int i = 0; i < data["patches"].size(); i++) {
+    if (progress.cancelled.load()) return;
+    project.patches.push_back(LoadPhiMapImage(fmt::format("{}/{}.png", folder, i).c_str()));
+    progress.fraction.store(project.patches.size() / total);
+  }
+  for (auto e : data["backgrounds"]) {
+    if (progress.cancelled.load()) return;
+    std::string png_filename = e["file"];
+    project.backgrounds.push_back(LoadBackgroundImage(png_filename.c_str()));
+    progress.fraction.store((project.patches.size() + project.backgrounds.size()) / total);
+  }
+  if (!read_data) return progress.fraction.store(1.f);
+  char * bin_filename = TextReplace((char*) filename.c_str(), ".json", ".bin");
+  std::string bin_name = bin_filename;
+  free(bin_filename);
+  fmt::print("Reading {}.\n\f", bin_name);
+  ProjectFile pf;
+  bool chunked;
+  if (ProjectFileOpen(bin_name.c_str(), pf, &chunked)) ReadProjectLayers(bin_name.c_str(), pf, project, progress);
+  else if (chunked) fmt::print("{} is damaged or from a newer version, only the images are loaded.\n", bin_name);
+  else ReadProjectLegacy(bin_name.c_str(), project);
+  ProjectFileClose(pf);
+  progress.fraction.store(1.f);
+}
 
+void
+ReleaseStep(ApplicationState& app, int i) {
+  // Frees step i unless it is a view into the project file, which is unmapped once no step uses it.
+  UnloadTilePyramid(app.steps_pyr[i]);
+  app.steps_pyr[i] = nullptr;
+  if (app.steps[i].data && !ProjectMappingOwns(app.steps_mapping, app.steps[i].data)) UnloadImage(app.steps[i]);
+  app.steps[i] = (Image) {0};
+  if (!ProjectMappingOwns(app.steps_mapping, app.steps[0].data) && !ProjectMappingOwns(app.steps_mapping, app.steps[1].data)) {
+    ProjectFileUnmap(app.steps_mapping);
+  }
+}
+
+TilePyramid *
+StepPyramid(ApplicationState& app, int i) {
+  // Loaded steps get their pyramid when first shown, so unseen ones are never read from disk.
+  if (!app.steps_pyr[i] && app.steps[i].data) app.steps_pyr[i] = TilePyramidCreate(app.steps[i]);
+  return app.steps_pyr[i];
+}
+
+void
+ApplyProject(ApplicationState & app, ProjectData& project) {
+  // Main thread: takes the images and buffers over, and creates the textures.
+  PROFILE_SCOPE("load apply");
+  json& data = project.data;
   if (data.count("global") > 0) {
     app.global_angle = data["global"]["angle"];
     app.global_scale = data["global"]["scale"];
   }
-  if (data.count("ui") > 0) {
+  if (data.count("ui") > 0) {
     auto ui_data = data["ui"];
     if (ui_data.count("boundaries_color") > 0) {
       auto e = ui_data["boundaries_color"];
@@ -286,64 +670,100 @@ LoadAll(char* filename, ApplicationState & app) {
     }
   }
 
+  for (auto & im : app.images) UnloadPatch(im);
+  app.phimap_live.active = false;
+  UnloadAtlas(app.atlas);
   app.images.clear();
+  app.patch_grid.bounds.clear();
   app.folder = data["global"]["folder"];
   for (int i = 0; i < data["patches"].size(); i++) {
       auto d = data["patches"][i];
-      app.images.push_back(LoadPhiMapJSON(fmt::format("{}/{}.png",app.folder, i).c_str(), d, i));
+      app.images.push_back(LoadPhiMapJSON(project.patches[i], d, i, app.atlas));
+      project.patches[i].data = nullptr;
   }
 
+  int i = 0;
   for (auto e : data["backgrounds"]) {
     std::string png_filename = e["file"];
-    Image bg = LoadImage(png_filename.c_str());
-    Texture2D tex = LoadTextureFromImage(bg);
-    app.backgrounds.push_back(PhiMap(e["x"], e["y"], e["w"], e["h"], e["r"], tex, false, false, 0));
+    app.backgrounds.push_back(LoadBackground(project.backgrounds[i], png_filename.c_str(), e["x"], e["y"], e["w"], e["h"], e["r"]));
+    project.backgrounds[i++].data = nullptr;
     if (e.contains("alpha")) arrput(app.backgrounds_alpha, e["alpha"]);
     else arrput(app.backgrounds_alpha, 0.5);
-    app.backgrounds.back().filename = png_filename;
-    int count = 0;
-    const char ** extension = TextSplit(GetFileName(png_filename.c_str()), '.', &count);
-    app.backgrounds.back().type =  fmt::format("{}", extension[1]);
   }
-  FILE *read_ptr;
-  std::size_t buffer_len;
-  char * bin_filename = TextReplace(filename, ".json", ".bin");
-  fmt::print("Reading {}.\n\f", bin_filename);
-  read_ptr = fopen(bin_filename,"rb");
-  if (read_ptr)
-  {
-    fread(&buffer_len, sizeof(std::size_t), 1, read_ptr);
-    uint8_t *buffer = (uint8_t*) malloc(buffer_len);
-    fread(buffer, buffer_len-sizeof(std::size_t), 1, read_ptr);
-    std::size_t *buffer_as_sizet = (std::size_t*)buffer;
-    std::size_t width = buffer_as_sizet[0];
-    std::size_t height = buffer_as_sizet[1];
-    std::size_t format = buffer_as_sizet[2];
-    buffer = (uint8_t*) (buffer_as_sizet+3);
-    std::size_t imlength = width*height;
-    printf("Loading %lu x %lu images for a total of %lu bytes.\n\f", width, height, buffer_len);
-    assert(buffer_len > 0);
-    for_range(i, 5) {
-      app.steps[i].data = (uint8_t*) malloc(imlength*4*sizeof(uint8_t));
-      app.steps[i].height = height;
-      app.steps[i].width = width;
-      app.steps[i].format = format;
-      memcpy(app.steps[i].data, buffer, imlength*4*sizeof(uint8_t));
-      buffer += imlength*4*sizeof(uint8_t);
-      UnloadTexture(app.steps_tex[i]);
-      app.steps_tex[i] = LoadTextureFromImage(app.steps[i]);
+  if (project.steps[0].data) {
+    for_range(i, 2) ReleaseStep(app, i);
+    for_range(i, 2) {
+      app.steps[i] = project.steps[i];
+      project.steps[i].data = nullptr;
     }
+    app.steps_mapping = project.mapping;
+    project.mapping = ProjectMapping();
+    app.layer_versions[0]++;
+    app.layer_versions[1]++;
     // Segmentations
+    app.label_undo.clear();
+    ClearSelection(app);
     for_range(i, 3) {
-      app.segmentations[i] = (std::size_t*) malloc(imlength*sizeof(std::size_t));
-      memcpy(app.segmentations[i], buffer, imlength*sizeof(std::size_t));
-      buffer += imlength*sizeof(std::size_t);
+      free(app.segmentations[i]);
+      app.segmentations[i] = project.segmentations[i];
+      project.segmentations[i] = nullptr;
+      MarkLabelsDirty(app, i, {0, 0, (float) app.steps[0].width, (float) app.steps[0].height});
     }
-    fclose(read_ptr);
+    // Saving back to that file copies the layers still unchanged.
+    app.saved.bin = project.source;
+    for_range(k, 5) app.saved.versions[k] = app.layer_versions[k];
   }
+  app.file_loaded = 1;
 }
-void SaveAll(char* filename, ApplicationState& app) {
-  fmt::print("Saving {}\n", filename);
+
+std::string
+AutosaveName(std::string project_name) {
+  // Next to the project, in the working directory for a new one.
+  if (project_name.empty()) return "autosave.json";
+  if (TextIsEqual(GetFileName(project_name.c_str()), "autosave.json") || project_name.find(".autosave.json") != std::string::npos) return project_name;
+  return project_name.substr(0, project_name.size() - strlen(".json")) + ".autosave.json";
+}
+
+void
+LoadAll(char* filename, ApplicationState & app) {
+  std::string name = filename;
+  app.project_name = name;
+  std::string autosave = AutosaveName(name);
+  if (FileExists(autosave.c_str()) && GetFileModTime(autosave.c_str()) > GetFileModTime(filename)) {
+    fmt::print("{} is more recent than the project, open it to recover unsaved work.\n", autosave);
+  }
+  auto project = std::make_shared<ProjectData>();
+  JobSubmit(app.jobs, "Loading project", JOB_ALL, nullptr,
+    [name, project](JobProgress& progress) { ReadProject(name, *project, progress); },
+    [&app, project]() { ApplyProject(app, *project); });
+}
+
+struct ProjectSnapshot {
+/*
+    What a save writes. The step images are used in place: only jobs change
+    them, and those wait for the save, which holds every resource. Label maps
+    are edited on the main thread at any time, so the save shares their
+    encoded strips (copy on write, see EncodedLabels). Layers unchanged since
+    the file was last written or read are copied from it instead.
+*/
+  std::string json_text;
+  std::string bin_name;
+  Image steps[2] = {{0}, {0}};              // Not owned
+  EncodedLabels labels[3];                  // Empty when copied
+  bool copied[5] = {false, false, false, false, false};
+  uint32_t versions[5] = {0};
+  bool ok = false;
+};
+
+static std::string
+project_layer_name(int k) {
+  // Chunk types of the layers, indexed as ApplicationState::layer_versions.
+  return k < 2 ? fmt::format("STEP{}", k) : fmt::format("LABELS{}", k - 2);
+}
+
+void
+SnapshotProject(ApplicationState& app, ProjectSnapshot& snapshot, const SavedLayers& target) {
+  PROFILE_SCOPE("save snapshot");
   json data;
   data["patches"] = json::array();
   for (int i = 0; i < app.images.size(); i++) {
@@ -362,52 +782,771 @@ void SaveAll(char* filename, ApplicationState& app) {
   bc.push_back(app.boundaries_color.g);
   bc.push_back(app.boundaries_color.b);
   data["ui"]["boundaries_color"] = bc;
-  
-  // Write to disk
-  std::ofstream f(filename);
-  f << data;
-  f.close();
-
-  if(app.steps_initialized) {
-    // Save data
-    std::size_t buffer_size = 4 * sizeof(std::size_t);
-    // Steps images
+  snapshot.json_text = data.dump();
+
+  if(app.steps_initialized && app.segmentations[0]) {
+    // Steps 2 to 4 are boundary previews, rebuilt from the segmentations on load.
     std::size_t imlength = app.steps[0].width*app.steps[0].height;
-    for_range(i, 5) {
-      buffer_size += imlength*4*sizeof(uint8_t);
+    for_range(k, 5) {
+      snapshot.versions[k] = app.layer_versions[k];
+      snapshot.copied[k] = target.bin == snapshot.bin_name && target.versions[k] == app.layer_versions[k];
     }
-    // Segmentations
+    for_range(i, 2) snapshot.steps[i] = app.steps[i];
     for_range(i, 3) {
-      buffer_size += imlength*sizeof(std::size_t);
-    }
-    uint8_t *buffer = (uint8_t*) malloc(buffer_size);
-    uint8_t *cursor = buffer;
-    std::size_t *buffer_as_sizet = (std::size_t*)buffer;
-    buffer_as_sizet[0] = buffer_size;
-    buffer_as_sizet[1] = app.steps[0].width;
-    buffer_as_sizet[2] = app.steps[0].height;
-    buffer_as_sizet[3] = app.steps[0].format;
-    cursor = (uint8_t*)(buffer_as_sizet + 4);
-    for_range(i, 5) {
-      memcpy(cursor, app.steps[i].data, imlength*4*sizeof(uint8_t));
-      cursor += imlength*4*sizeof(uint8_t);
+      if (snapshot.copied[2 + i]) continue;
+      // Only the strips edited since the last snapshot are encoded, the others are shared.
+      ProjectFileEncodeLabels(app.labels_encoded[i], (const uint64_t*) app.segmentations[i], imlength);
+      snapshot.labels[i] = app.labels_encoded[i];
     }
-    // Segmentations
-    for_range(i, 3) {
-      memcpy(cursor, app.segmentations[i], imlength*sizeof(std::size_t));
-      cursor += imlength*sizeof(std::size_t);
+  }
+}
+
+static bool
+write_replacing(const std::string& path, const std::function<bool(const std::string&)>& write) {
+  // Writes path aside and renames it over, so a failed or interrupted save leaves the old file whole.
+  std::string tmp = path + ".tmp";
+  if (write(tmp) && rename(tmp.c_str(), path.c_str()) == 0) return true;
+  remove(tmp.c_str());
+  return false;
+}
+
+void
+WriteProject(std::string filename, ProjectSnapshot& snapshot, JobProgress& progress) {
+  PROFILE_SCOPE("save");
+  snapshot.ok = true;
+  if (snapshot.steps[0].data) {
+    fmt::print("Writing {}.\n\f", snapshot.bin_name);
+    TRACE_SCOPE("write bin", "io");
+    // Replacing the file also keeps the steps valid when they are mapped from it.
+    snapshot.ok = write_replacing(snapshot.bin_name, [&snapshot, &progress](const std::string& tmp) {
+      Image& start = snapshot.steps[0];
+      std::size_t imlength = start.width*start.height;
+      ProjectFile previous, pf;
+      bool copying = false;
+      for_range(k, 5) copying = copying || snapshot.copied[k];
+      if (copying) ProjectFileOpen(snapshot.bin_name.c_str(), previous); // Steps missing from it are written
+      bool ok = ProjectFileCreate(tmp.c_str(), pf);
+      for_range(k, 5) {
+        if (!ok) break;
+        std::string type = project_layer_name(k);
+        const ChunkInfo *old = snapshot.copied[k] ? ProjectFileFind(previous, type.c_str()) : nullptr;
+        if (old) ok = ProjectFileCopyChunk(pf, previous, *old);
+        else if (snapshot.copied[k] && k >= 2) ok = false; // The labels were not encoded
+        else if (k < 2) ok = ProjectFileWriteChunk(pf, type.c_str(), 1, CHUNK_RAW, snapshot.steps[k].data, imlength*4,
+                                                   snapshot.steps[k].width, snapshot.steps[k].height, snapshot.steps[k].format);
+        else ok = ProjectFileWriteEncoded(pf, type.c_str(), 1, snapshot.labels[k - 2], start.width, start.height);
+        progress.fraction.store((k + 1) / 6.f);
+      }
+      ProjectFileClose(previous);
+      if (pf.f) ok = ProjectFileFinish(pf) && ok;
+      return ok;
+    });
+    if (!snapshot.ok) fmt::print("Writing the project layers failed, {} is unchanged.\n", snapshot.bin_name);
+  }
+  TRACE_SCOPE("write json", "io");
+  bool json_ok = write_replacing(filename, [&snapshot](const std::string& tmp) {
+    std::ofstream f(tmp);
+    f << snapshot.json_text;
+    f.close();
+    return f.good();
+  });
+  if (!json_ok) fmt::print("Writing {} failed, it is unchanged.\n", filename);
+  progress.fraction.store(1.f);
+}
+
+void SaveAll(char* filename, ApplicationState& app, bool autosave=false) {
+  // The state is taken when the job starts, after the jobs queued before it.
+  fmt::print("{} {}\n", autosave ? "Autosaving" : "Saving", filename);
+  std::string name = filename;
+  if (!autosave) app.project_name = name;
+  SavedLayers& target = autosave ? app.autosaved : app.saved;
+  auto snapshot = std::make_shared<ProjectSnapshot>();
+  char * bin_filename = TextReplace(filename, ".json", ".bin");
+  snapshot->bin_name = bin_filename;
+  free(bin_filename);
+  Job *job = JobSubmit(app.jobs, autosave ? "Autosaving project" : "Saving project", JOB_ALL,
+    [&app, &target, snapshot, autosave](JobProgress& progress) {
+      if (autosave) app.autosave_pending = false;
+      SnapshotProject(app, *snapshot, target);
+      bool unchanged = target.json == snapshot->json_text;
+      for_range(k, 5) unchanged = unchanged && (!snapshot->steps[0].data || snapshot->copied[k]);
+      if (autosave && unchanged) progress.cancelled.store(true); // Nothing new to autosave
+    },
+    [name, snapshot](JobProgress& progress) { WriteProject(name, *snapshot, progress); },
+    [&target, snapshot]() {
+      target.json = snapshot->json_text;
+      if (!snapshot->steps[0].data) return;
+      // A failed save may have left nothing to copy from, the next one writes every layer.
+      target.bin = snapshot->ok ? snapshot->bin_name : "";
+      for_range(k, 5) target.versions[k] = snapshot->versions[k];
+    });
+  job->cancellable = false; // A half-written file is worse than waiting
+}
+
+void
+UpdateAutosave(ApplicationState& app) {
+/*
+    Every AUTOSAVE_SECONDS, saves next to the project (see AutosaveName) in
+    the background. Taking the snapshot costs the JSON and the label strips
+    edited since the last one; layers unchanged in the autosave file are
+    copied from it, and a save with nothing new is dropped before writing.
+*/
+  if (GetTime() - app.autosave_time < AUTOSAVE_SECONDS) return;
+  app.autosave_time = GetTime();
+  if (app.autosave_pending || (app.images.empty() && app.backgrounds.empty())) return;
+  app.autosave_pending = true;
+  std::string name = AutosaveName(app.project_name);
+  SaveAll((char*) name.c_str(), app, true);
+}
+
+void
+SubmitTraceExport(ApplicationState& app, const char *filename) {
+  // The events so far, for chrome://tracing or ui.perfetto.dev.
+  auto snapshot = std::make_shared<TraceSnapshot>();
+  std::string name = filename;
+  JobSubmit(app.jobs, "Exporting trace", 0,
+    [snapshot](JobProgress&) { TraceTakeSnapshot(*snapshot); },
+    [snapshot, name](JobProgress& progress) {
+      TraceWriteChrome(*snapshot, name.c_str());
+      fmt::print("Trace of {} events written to {}.\n", snapshot->events.size(), name);
+      progress.fraction.store(1.f);
+    },
+    nullptr);
+}
+
+std::vector<CompositeLayer>
+PhimapLayers(const std::vector<PhiMap>& patches, const PhiMap& bg, float scale, float angle, int px, int py) {
+  // The patches as placed on the canvas, in pixels of a px x py map covering bg, one layer per patch.
+  std::vector<CompositeLayer> layers;
+  for (auto & im : patches) {
+    Rectangle dest = {px*(im.x-bg.x)/bg.w, py*(im.y-bg.y)/bg.h, px*im.w*2*scale/bg.w, py*im.h*2*scale/bg.h};
+    layers.push_back({im.image, {0.f, 0.f, (float) im.image.width, (float) im.image.height}, dest, angle, WHITE});
+  }
+  return layers;
+}
+
+void
+SubmitTileExport(ApplicationState& app) {
+/*
+    Tile pyramids of the phimap and of the step-2 labels, rendered tile by
+    tile by the job. The phimap is composited again from the patches while it
+    follows them (the main thread redraws it as they move); otherwise only
+    jobs change it and they wait for this one, so it is read in place. The
+    labels, edited on the main thread, are copied as they are.
+*/
+  struct TileExportData {
+    TileProducer phimap;
+    int phimap_width = 0, phimap_height = 0;
+    std::size_t *labels = nullptr;
+    int nx = 0, ny = 0;
+    ~TileExportData() { free(labels); }
+  };
+  auto d = std::make_shared<TileExportData>();
+  JobSubmit(app.jobs, "Exporting tiles", JOB_PHIMAP | JOB_LABELS,
+    [&app, d](JobProgress& progress) {
+      LivePhimap& live = app.phimap_live;
+      if (app.phimap.data) {
+        d->phimap_width = app.phimap.width;
+        d->phimap_height = app.phimap.height;
+        if (live.active && live.base == app.segmentation_base && live.base < app.backgrounds.size()) {
+          auto layers = PhimapLayers(app.images, app.backgrounds[live.base], app.global_scale, app.global_angle, app.phimap.width, app.phimap.height);
+          d->phimap = TilesFromLayers(layers, WHITE, COMPOSITE_AREA);
+        } else {
+          d->phimap = TilesFromImage(app.phimap);
+        }
+      }
+      if (app.segmentations[2]) {
+        d->nx = app.steps[0].width;
+        d->ny = app.steps[0].height;
+        std::size_t length = (std::size_t) d->nx * d->ny * sizeof(std::size_t);
+        d->labels = (std::size_t*) malloc(length);
+        memcpy(d->labels, app.segmentations[2], length);
+      }
+      if (!d->phimap && !d->labels) progress.cancelled.store(true);
+    },
+    [d](JobProgress& progress) {
+      if (d->phimap && ExportTiles(d->phimap_width, d->phimap_height, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, d->phimap, "phimap_tiles", TILE_REDUCE_MEAN, &progress)) {
+        fmt::print("Phimap tiles written to phimap_tiles/.\n");
+      }
+      if (d->labels && ExportTiles(d->nx, d->ny, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, TilesFromLabels(d->labels, d->nx), "labels_tiles", TILE_REDUCE_NEAREST, &progress, "label32")) {
+        fmt::print("Label tiles written to labels_tiles/.\n");
+      }
+    },
+    nullptr);
+}
+
+void
+SubmitPhimapStatistics(ApplicationState& app) {
+/*
+    Per-grain statistics of the phimap on the step-2 labels (see
+    phimap_stats.h), written to phimap_segments.csv, with the phimap painted
+    by segment in phimap_smoothed.png. Only for the patch composite [p] of
+    the segmentation base, which the job composites again from the patches as
+    they stand when it starts; the labels are copied.
+*/
+  struct StatisticsData {
+    std::vector<CompositeLayer> layers;
+    int width = 0, height = 0;
+    std::size_t *labels = nullptr;
+    int nx = 0, ny = 0;
+    Image smoothed = {0};
+    ~StatisticsData() {
+      free(labels);
+      if (smoothed.data) UnloadImage(smoothed);
     }
-    printf("Writing %lu bytes\n", buffer_size);
-    char * bin_filename = TextReplace(filename, ".json", ".bin");
-    fmt::print("Writing {}.\n\f", bin_filename);
-    FILE *write_ptr = NULL;
-    write_ptr = fopen(bin_filename,"wb");
-    assert(write_ptr);
-    fwrite(buffer, sizeof(uint8_t), buffer_size, write_ptr);
-    fclose(write_ptr);
+  };
+  auto d = std::make_shared<StatisticsData>();
+  JobSubmit(app.jobs, "Phimap statistics", JOB_PHIMAP | JOB_LABELS,
+    [&app, d](JobProgress& progress) {
+      LivePhimap& live = app.phimap_live;
+      if (app.phimap.data == nullptr) {
+        fmt::print("Warning: phimap [p] was not computed\n");
+        return progress.cancelled.store(true);
+      }
+      if (!live.active || live.base != app.segmentation_base || live.base >= app.backgrounds.size() || !app.segmentations[2]) {
+        fmt::print("Warning: the phimap is not the patch composite [p] of this base, compute it again\n");
+        return progress.cancelled.store(true);
+      }
+      d->width = app.phimap.width;
+      d->height = app.phimap.height;
+      d->layers = PhimapLayers(app.images, app.backgrounds[live.base], app.global_scale, app.global_angle, d->width, d->height);
+      d->nx = app.steps[0].width;
+      d->ny = app.steps[0].height;
+      std::size_t length = (std::size_t) d->nx * d->ny * sizeof(std::size_t);
+      d->labels = (std::size_t*) malloc(length);
+      memcpy(d->labels, app.segmentations[2], length);
+    },
+    [d](JobProgress& progress) {
+      Image phimap = {malloc((std::size_t) d->width * d->height * 4), d->width, d->height, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+      assert(phimap.data);
+      CompositeLayers(phimap, d->layers, (Rectangle) {0, 0, (float) d->width, (float) d->height}, WHITE, COMPOSITE_AREA);
+      progress.fraction.store(0.3f);
+      std::size_t num_segments = 0;
+      segment_phi_stats *stats = phimap_segment_statistics(phimap, d->labels, d->nx, d->ny, &num_segments);
+      UnloadImage(phimap);
+      progress.fraction.store(0.5f);
+      d->smoothed = ImageFromSegmentPhiStats(stats, num_segments, d->labels, d->nx, d->ny, d->width, d->height);
+      phimap_statistics_write_csv("phimap_segments.csv", stats, num_segments);
+      free(stats);
+      progress.fraction.store(0.6f);
+      TRACE_SCOPE("export png", "io");
+      ExportImage(d->smoothed, "phimap_smoothed.png");
+      fmt::print("Statistics of {} segments written to phimap_segments.csv and phimap_smoothed.png.\n", num_segments);
+      progress.fraction.store(1.f);
+    },
+    [&app, d]() {
+      if (app.phimap_smoothed.data) UnloadImage(app.phimap_smoothed);
+      app.phimap_smoothed = d->smoothed;
+      d->smoothed.data = nullptr;
+    });
+}
+
+Rectangle
+FocusPixels(ApplicationState& app, Image& start) {
+  // The focus zone in pixels of the segmentation base.
+  PhiMap & bg = app.backgrounds[app.segmentation_base];
+  float x0 = bg.x, y0 = bg.y, w0 = bg.w,h0 = bg.h;
+  Rectangle fi = app.focus_zone;
+  return (Rectangle) { round((fi.x - x0) / w0 * start.width), round((fi.y - y0) / h0 * start.height), round(fi.width/w0*start.width), round(fi.height/h0*start.height)};
+}
+
+bool
+InsideImage(Rectangle r, const Image& im) {
+  return r.x >= 0 && r.y >= 0 && r.width >= 1 && r.height >= 1 && r.x + r.width <= im.width && r.y + r.height <= im.height;
+}
+
+struct StageData {
+  // Inputs copied for a processing stage, and its result.
+  Image image = {0};
+  Image result = {0};
+  std::size_t *labels = nullptr;
+  int width = 0, height = 0;       // Size of the steps when the job started
+  ~StageData() {
+    if (image.data) UnloadImage(image);
+    if (result.data) UnloadImage(result);
+    free(labels);
   }
+};
+
+void
+SubmitDenoising(ApplicationState& app, bool whole, Rectangle focus_pixels) {
+  auto d = std::make_shared<StageData>();
+  auto params = app.params;
+  int base = app.segmentation_base;
+  JobSubmit(app.jobs, whole ? "Denoising" : "Denoising zone", JOB_STEPS,
+    [&app, d, whole, focus_pixels, base](JobProgress& progress) {
+      // Earlier jobs may have replaced the steps since the key was pressed.
+      if (whole ? base >= app.backgrounds.size() : !InsideImage(focus_pixels, app.steps[0])) progress.cancelled.store(true);
+      else d->image = whole ? ImageCopy(app.backgrounds[base].image) : ImageFromImage(app.steps[0], focus_pixels);
+      d->width = app.steps[0].width;
+      d->height = app.steps[0].height;
+    },
+    [d, params](JobProgress& progress) {
+      d->result = ImageCopy(d->image);
+      opencv_nlmeans_denoising(d->image, d->result, params.kl_strenght, params.kl_kernel, params.kl_search_window);
+      progress.fraction.store(1.f);
+    },
+    [&app, d, whole, focus_pixels]() {
+      if (whole) {
+        ReleaseStep(app, 0);
+        ReleaseStep(app, 1);
+        app.steps[0] = d->image;
+        app.steps[1] = d->result;
+        app.layer_versions[0]++;
+        app.layer_versions[1]++;
+        d->image.data = d->result.data = nullptr;
+        app.steps_pyr[0] = TilePyramidCreate(app.steps[0]);
+        app.steps_pyr[1] = TilePyramidCreate(app.steps[1]);
+      } else if (d->width == app.steps[1].width && d->height == app.steps[1].height) {
+        DrawImageOnImage(app.steps[1], d->result, focus_pixels);
+        TilePyramidUpdate(app.steps_pyr[1], focus_pixels);
+        app.layer_versions[1]++;
+      }
+    });
+}
+
+void
+SubmitQuickshift(ApplicationState& app, bool whole, Rectangle focus_pixels) {
+  auto d = std::make_shared<StageData>();
+  auto params = app.params;
+  JobSubmit(app.jobs, whole ? "Quickshift" : "Quickshift zone", JOB_STEPS | JOB_LABELS,
+    [&app, d, whole, focus_pixels](JobProgress& progress) {
+      if (!whole && !InsideImage(focus_pixels, app.steps[0])) return progress.cancelled.store(true);
+      d->image = whole ? ImageCopy(app.steps[1]) : ImageFromImage(app.steps[0], focus_pixels);
+      d->labels = (std::size_t*) malloc(d->image.width*d->image.height*sizeof(std::size_t));
+      d->width = app.steps[1].width;
+      d->height = app.steps[1].height;
+    },
+    [d, params](JobProgress& progress) {
+      quickshift(d->image, params.qs_kernel_size, params.qs_max_size, d->labels, params.qs_ratio, 42, &progress);
+    },
+    [&app, d, whole, focus_pixels]() {
+      Image& start = app.steps[1];
+      if (d->width != start.width || d->height != start.height) return;
+      EnsureWellAllocatedSegments(app);
+      int length = start.height*start.width;
+      if (whole) {
+        memcpy(app.segmentations[0], d->labels, length*sizeof(std::size_t));
+        auto offset = current_max_label(app, 0);
+        relabel_sequential(app.segmentations[0], length, offset);
+        MarkLabelsDirty(app, 0, {0, 0, (float) start.width, (float) start.height});
+      } else {
+        auto offset = current_max_label(app);
+        relabel_sequential(d->labels, d->image.width*d->image.height, offset);
+        DrawImageOnImageL(app.segmentations[0], d->labels, focus_pixels, start.width, start.height, 0);
+        MarkLabelsDirty(app, 0, focus_pixels);
+      }
+      // One mapping for all segmentations, boundaries are unchanged outside the edit.
+      relabel_sequential_global(app.segmentations, length);
+      for_range(i, 3) MarkLabelsChanged(app, i, {0, 0, (float) start.width, (float) start.height});
+      app.label_undo.clear();
+      ClearSelection(app); // Selected ids were renumbered
+    });
+}
+
+void
+SubmitRegionAdjacency(ApplicationState& app, bool whole, Rectangle focus_pixels) {
+  auto d = std::make_shared<StageData>();
+  auto params = app.params;
+  JobSubmit(app.jobs, whole ? "Region adjacency" : "Region adjacency zone", JOB_STEPS | JOB_LABELS,
+    [&app, d, whole, focus_pixels](JobProgress& progress) {
+      if (!whole && !InsideImage(focus_pixels, app.steps[0])) return progress.cancelled.store(true);
+      EnsureWellAllocatedSegments(app);
+      Image& start = app.steps[1];
+      d->width = start.width;
+      d->height = start.height;
+      if (whole) {
+        std::size_t length = start.width*start.height;
+        d->image = ImageCopy(start);
+        d->labels = (std::size_t*) malloc(length*sizeof(std::size_t));
+        memcpy(d->labels, app.segmentations[0], length*sizeof(std::size_t));
+      } else {
+        d->image = ImageFromImage(app.steps[0], focus_pixels);
+        d->labels = ImageFromImageL(app.segmentations[0], focus_pixels, start.width, start.height);
+      }
+    },
+    [d, params](JobProgress& progress) {
+      std::size_t width = d->image.width, height = d->image.height;
+      std::size_t length = height*width;
+      std::size_t num_components = maximum_label(d->labels, length) + 1;
+      rag r = rag_create(num_components);
+      rag_adjacency_matrix(r, d->labels, width, height);
+      progress.fraction.store(0.25f);
+
+      float *im_float = uint8_to_float((uint8_t*)d->image.data, length, 4, 3);
+      rag_color_distance_matrix(r, im_float, d->labels, width, height);
+      free(im_float);
+      progress.fraction.store(0.5f);
+
+      rag_merge(r, params.rag_threshold);
+      rag_relabel(r, d->labels, length);
+      progress.fraction.store(1.f);
+    },
+    [&app, d, whole, focus_pixels]() {
+      Image& start = app.steps[1];
+      if (d->width != start.width || d->height != start.height) return;
+      if (whole) {
+        memcpy(app.segmentations[1], d->labels, start.width*start.height*sizeof(std::size_t));
+        MarkLabelsDirty(app, 1, {0, 0, (float) start.width, (float) start.height});
+      } else {
+        DrawImageOnImageL(app.segmentations[1], d->labels, focus_pixels, start.width, start.height, 0);
+        MarkLabelsDirty(app, 1, focus_pixels);
+      }
+      SplitDisconnectedSegments(app, 1);
+      ClearSelection(app);
+    });
+}
+
+std::vector<CompositeLayer>
+CompoundLayers(const std::vector<PhiMap>& backgrounds, const PhiMap& bg, int px, int py) {
+  // One colour channel per background, placed as on the canvas, in pixels of a px x py map covering bg.
+  Color bgcolors[3] = {{255,0,0,255}, {0,255,0,128}, {0,0,255, 85}};
+  std::vector<CompositeLayer> layers;
+  for (int i = 0; i < backgrounds.size(); i++) {
+    const PhiMap& im = backgrounds[i];
+    Rectangle dest = {px*(im.x-bg.x)/bg.w, py*(im.y-bg.y)/bg.h, px*im.w/bg.w, py*im.h/bg.h};
+    layers.push_back({im.gray, {0.f, 0.f, (float) im.image.width, (float) im.image.height}, dest, im.rotation_deg, bgcolors[i % 3]});
+  }
+  return layers;
+}
+
+void
+SubmitPhimapComposite(ApplicationState& app, int mul, bool compound) {
+/*
+    Composites the patches (or, for the compound background, the grayscale
+    backgrounds) at mul times the resolution of the segmentation base, saves
+    the result and shows it as the phimap. Runs entirely on the CPU.
+    Grayscale backgrounds missing from the cache are made by the job and
+    cached when it ends.
+*/
+  struct CompositeData {
+    std::vector<CompositeLayer> layers;
+    std::vector<int> missing;        // Layers (backgrounds) without a cached grayscale copy
+    std::vector<Image> gray;         // Their copies, made by the job
+    Image out = {0};
+    int base = 0;
+    ~CompositeData() {
+      for (auto & im : gray) if (im.data) UnloadImage(im);
+      if (out.data) UnloadImage(out);
+    }
+  };
+  auto d = std::make_shared<CompositeData>();
+  std::string name = compound ? "compound_background.png" : "phimap_new.png";
+  JobSubmit(app.jobs, fmt::format("Compositing {}", name), JOB_PHIMAP,
+    [&app, d, mul, compound](JobProgress& progress) {
+      if (app.segmentation_base >= app.backgrounds.size()) return progress.cancelled.store(true);
+      PhiMap & bg = app.backgrounds[app.segmentation_base];
+      int px = mul * bg.image.width, py = mul * bg.image.height;
+      d->base = app.segmentation_base;
+      d->out = (Image) {nullptr, px, py, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+      if (!compound) {
+        d->layers = PhimapLayers(app.images, bg, app.global_scale, app.global_angle, px, py);
+        return;
+      }
+      d->layers = CompoundLayers(app.backgrounds, bg, px, py);
+      for (int i = 0; i < app.backgrounds.size(); i++) {
+        if (app.backgrounds[i].gray.data) continue;
+        d->missing.push_back(i);
+        d->gray.push_back(app.backgrounds[i].image);  // Source until the job replaces it
+      }
+    },
+    [d, name, compound](JobProgress& progress) {
+      PROFILE_SCOPE("composite");
+      Image& out = d->out;
+      out.data = malloc((std::size_t) out.width * out.height * 4);
+      assert(out.data);
+      for (std::size_t k = 0; k < d->missing.size(); k++) {
+        Image gray = ImageCopy(d->gray[k]);
+        ImageColorGrayscale(&gray);
+        ImageFormat(&gray, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+        d->gray[k] = gray;
+        d->layers[d->missing[k]].image = gray;
+      }
+      progress.fraction.store(0.1f);
+      Rectangle all = {0, 0, (float) out.width, (float) out.height};
+      CompositeLayers(out, d->layers, all, compound ? BLACK : WHITE, COMPOSITE_AREA);
+      if (compound) CompositeNormalize(out);
+      progress.fraction.store(0.5f);
+      TRACE_SCOPE("export png", "io");
+      ExportImage(out, name.c_str());
+      progress.fraction.store(1.f);
+    },
+    [&app, d, compound]() {
+      for (std::size_t k = 0; k < d->missing.size(); k++) {
+        PhiMap& bg = app.backgrounds[d->missing[k]];
+        if (bg.gray.data) continue;
+        bg.gray = d->gray[k];
+        d->gray[k].data = nullptr;
+      }
+      UnloadTilePyramid(app.phimap_pyr);
+      if (app.phimap.data) UnloadImage(app.phimap);
+      app.phimap = d->out;
+      d->out.data = nullptr;
+      app.phimap_pyr = TilePyramidCreate(app.phimap);
+      // Patches moved since prepare are caught up by the next UpdateLivePhimap.
+      app.phimap_live.active = !compound;
+      app.phimap_live.base = d->base;
+      app.phimap_live.footprints.clear();
+      for (auto & layer : d->layers) app.phimap_live.footprints.push_back(CompositeLayerBounds(layer));
+    });
+}
+
+void
+SubmitPatchRegistration(ApplicationState& app, bool whole) {
+/*
+    Moves every patch to where it best matches the segmentation base, near
+    its current place (anywhere on the base when whole is set), see
+    registration.h. Patches scoring below REGISTRATION_MIN_SCORE stay where
+    they are; every score is shown on its patch.
+*/
+  struct RegistrationData {
+    Image base = {0};                          // Pixels of the segmentation base, not owned
+    float unit_x, unit_y;                      // Canvas units per base pixel
+    std::vector<CompositeLayer> layers;
+    std::vector<Vector2> start;                // Patch positions the layers were made from
+    std::vector<RegistrationResult> results;
+  };
+  auto d = std::make_shared<RegistrationData>();
+  JobSubmit(app.jobs, "Registering patches", JOB_PHIMAP,
+    [&app, d](JobProgress& progress) {
+      if (app.segmentation_base >= app.backgrounds.size() || app.images.empty()) return progress.cancelled.store(true);
+      PhiMap & bg = app.backgrounds[app.segmentation_base];
+      d->base = bg.image;
+      d->unit_x = bg.w / bg.image.width;
+      d->unit_y = bg.h / bg.image.height;
+      d->layers = PhimapLayers(app.images, bg, app.global_scale, app.global_angle, bg.image.width, bg.image.height);
+      for (auto & im : app.images) d->start.push_back((Vector2) {im.x, im.y});
+      d->results.resize(d->layers.size());
+    },
+    [d, whole](JobProgress& progress) {
+      PROFILE_SCOPE("registration");
+      std::vector<cv::Mat> scene = RegistrationPyramid(RegistrationGray(d->base), REGISTRATION_MAX_LEVELS);
+      std::atomic<int> done{0};
+      ParallelFor(0, d->layers.size(), 1, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t i = lo; i < hi && !progress.cancelled.load(); i++) {
+          // The patch alone, as placed, cut at its bounds.
+          CompositeLayer layer = d->layers[i];
+          Rectangle bounds = CompositeLayerBounds(layer);
+          cv::Point expected = cv::Point(floorf(bounds.x), floorf(bounds.y));
+          int w = ceilf(bounds.x + bounds.width) - expected.x, h = ceilf(bounds.y + bounds.height) - expected.y;
+          if (layer.image.data && w >= REGISTRATION_MIN_SIZE && h >= REGISTRATION_MIN_SIZE) {
+            layer.dest.x -= expected.x;
+            layer.dest.y -= expected.y;
+            Image patch = (Image) {malloc((std::size_t) w * h * 4), w, h, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+            assert(patch.data);
+            // Area sampling: patches are usually shrunk to the base resolution, bilinear would alias.
+            CompositeLayers(patch, {layer}, (Rectangle) {0, 0, (float) w, (float) h}, BLANK, COMPOSITE_AREA);
+            int radius = whole ? MAXVAL(d->base.width, d->base.height) : MAXVAL(w, h) / 2;
+            d->results[i] = RegisterTemplate(scene, RegistrationGray(patch, true), expected, radius);
+            UnloadImage(patch);
+          }
+          progress.fraction.store((float) ++done / d->layers.size());
+        }
+      });
+    },
+    [&app, d]() {
+      int moved = 0;
+      UpdatePatchGrid(app);
+      for (std::size_t i = 0; i < d->results.size() && i < app.images.size(); i++) {
+        PhiMap& im = app.images[i];
+        RegistrationResult& r = d->results[i];
+        im.registration_score = r.score;
+        if (r.score < REGISTRATION_MIN_SCORE) continue;
+        // The match is relative to where the patch was when the job started, it may have been dragged since.
+        im.x = d->start[i].x + r.dx * d->unit_x;
+        im.y = d->start[i].y + r.dy * d->unit_y;
+        PatchGridMove(app.patch_grid, i, GetPhiMapBounds(im, app.global_scale, app.global_angle));
+        moved++;
+      }
+      fmt::print("Registration moved {} of {} patches.\n", moved, d->results.size());
+    });
+}
+
+void
+SubmitPatchRefinement(ApplicationState& app) {
+/*
+    Measures the offset between every two overlapping patches and moves all
+    the patches at once so the offsets agree, see registration.h. Works at
+    the resolution of the first patch.
+*/
+  struct RefinementData {
+    float unit;                                // Pixels per canvas unit
+    std::vector<CompositeLayer> layers;
+    std::vector<PatchPair> candidates;
+    std::vector<Rectangle> overlaps;
+    std::vector<bool> measured;
+    std::vector<double> ux, uy;
+  };
+  auto d = std::make_shared<RefinementData>();
+  JobSubmit(app.jobs, "Refining patch positions", JOB_PHIMAP,
+    [&app, d](JobProgress& progress) {
+      if (app.images.size() < 2 || !app.images[0].image.data) return progress.cancelled.store(true);
+      PhiMap& first = app.images[0];
+      d->unit = first.image.width / (first.w * 2 * app.global_scale);
+      for (auto & im : app.images) {
+        Rectangle dest = {im.x * d->unit, im.y * d->unit, im.w * 2 * app.global_scale * d->unit, im.h * 2 * app.global_scale * d->unit};
+        d->layers.push_back({im.image, {0.f, 0.f, (float) im.image.width, (float) im.image.height}, dest, app.global_angle, WHITE});
+      }
+      // Overlapping pairs, from the patch grid.
+      UpdatePatchGrid(app);
+      std::vector<int> found;
+      for (int i = 0; i < app.images.size(); i++) {
+        PatchGridQuery(app.patch_grid, app.patch_grid.bounds[i], found);
+        Rectangle a = CompositeLayerBounds(d->layers[i]);
+        for (int j : found) {
+          if (j <= i) continue;
+          Rectangle overlap = GetCollisionRec(a, CompositeLayerBounds(d->layers[j]));
+          if (overlap.width < PAIR_MIN_OVERLAP || overlap.height < PAIR_MIN_OVERLAP) continue;
+          d->candidates.push_back({i, j, 0, 0, 0});
+          d->overlaps.push_back(overlap);
+        }
+      }
+      if (d->candidates.empty()) progress.cancelled.store(true);
+    },
+    [d](JobProgress& progress) {
+      PROFILE_SCOPE("pairs refinement");
+      d->measured.assign(d->candidates.size(), false);
+      std::atomic<int> done{0};
+      ParallelFor(0, d->candidates.size(), 1, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t p = lo; p < hi && !progress.cancelled.load(); p++) {
+          PatchPair& pair = d->candidates[p];
+          d->measured[p] = MeasurePairOffset(d->layers[pair.i], d->layers[pair.j], d->overlaps[p], pair);
+          progress.fraction.store((float) ++done / d->candidates.size());
+        }
+      });
+      std::vector<PatchPair> pairs;
+      for (std::size_t p = 0; p < d->candidates.size(); p++) if (d->measured[p]) pairs.push_back(d->candidates[p]);
+      int inliers = 0;
+      double rms = SolvePairCorrections(d->layers.size(), pairs, d->ux, d->uy, &inliers);
+      fmt::print("Refinement: {} overlaps, {} measured, {} agreeing to {:.2f} px RMS.\n", d->candidates.size(), pairs.size(), inliers, rms);
+    },
+    [&app, d]() {
+      if (d->ux.size() != app.images.size()) return;
+      UpdatePatchGrid(app);
+      for (int i = 0; i < app.images.size(); i++) {
+        PhiMap& im = app.images[i];
+        im.x += d->ux[i] / d->unit;
+        im.y += d->uy[i] / d->unit;
+        PatchGridMove(app.patch_grid, i, GetPhiMapBounds(im, app.global_scale, app.global_angle));
+      }
+    });
+}
+
+void
+BackgroundToCanvas(const PhiMap& bg, double m[6]) {
+  // Affine map from the pixels of bg to the canvas, as the background is drawn.
+  double c = cos(bg.rotation_deg * DEG2RAD), s = sin(bg.rotation_deg * DEG2RAD);
+  double sx = bg.w / bg.image.width, sy = bg.h / bg.image.height;
+  double r[6] = {c * sx, -s * sy, bg.x, s * sx, c * sy, bg.y};
+  memcpy(m, r, sizeof(r));
+}
+
+void
+SetBackgroundFromCanvas(PhiMap& bg, const double m[6]) {
+  // Closest placement (position, size, rotation) to the affine map m; shear is dropped.
+  double rotation = atan2(m[3], m[0]);
+  double c = cos(rotation), s = sin(rotation);
+  bg.x = m[2];
+  bg.y = m[5];
+  bg.w = hypot(m[0], m[3]) * bg.image.width;
+  bg.h = (-m[1] * s + m[4] * c) * bg.image.height;
+  bg.rotation_deg = rotation / DEG2RAD;
+}
+
+void
+SubmitBackgroundAlignment(ApplicationState& app) {
+/*
+    Aligns every background to the segmentation base, all at once on the
+    pool, see AlignECC. Backgrounds aligned before start a few levels
+    finer, so running it again refines instead of searching again.
+*/
+  struct AlignmentData {
+    int base;
+    std::vector<Image> images;               // Not owned, images[base] is the base
+    std::vector<std::array<double, 6>> warps; // Base pixels to background pixels
+    std::vector<int> coarsest;
+    std::vector<float> scores;
+  };
+  auto d = std::make_shared<AlignmentData>();
+  JobSubmit(app.jobs, "Aligning backgrounds", JOB_PHIMAP,
+    [&app, d](JobProgress& progress) {
+      if (app.segmentation_base >= app.backgrounds.size() || app.backgrounds.size() < 2) return progress.cancelled.store(true);
+      d->base = app.segmentation_base;
+      double base_to_canvas[6];
+      BackgroundToCanvas(app.backgrounds[d->base], base_to_canvas);
+      for (auto & bg : app.backgrounds) {
+        std::array<double, 6> warp;
+        double bg_to_canvas[6], canvas_to_bg[6];
+        BackgroundToCanvas(bg, bg_to_canvas);
+        AffineInvert(bg_to_canvas, canvas_to_bg);
+        AffineCompose(canvas_to_bg, base_to_canvas, warp.data());
+        d->images.push_back(bg.image);
+        d->warps.push_back(warp);
+        d->coarsest.push_back(std::isnan(bg.alignment_score) ? REGISTRATION_MAX_LEVELS : 2);
+      }
+      d->scores.assign(d->images.size(), NAN);
+    },
+    [d](JobProgress& progress) {
+      PROFILE_SCOPE("alignment");
+      std::vector<cv::Mat> base = RegistrationPyramid(RegistrationGray(d->images[d->base]), REGISTRATION_MAX_LEVELS);
+      std::atomic<int> done{0};
+      ParallelFor(0, d->images.size(), 1, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t i = lo; i < hi && !progress.cancelled.load(); i++) {
+          if (i == d->base) continue;
+          std::vector<cv::Mat> moving = RegistrationPyramid(RegistrationGray(d->images[i]), REGISTRATION_MAX_LEVELS);
+          d->scores[i] = AlignECC(base, moving, d->warps[i].data(), d->coarsest[i]);
+          progress.fraction.store((float) ++done / (d->images.size() - 1));
+        }
+      });
+    },
+    [&app, d]() {
+      if (d->base >= app.backgrounds.size()) return;
+      double base_to_canvas[6];
+      BackgroundToCanvas(app.backgrounds[d->base], base_to_canvas);
+      for (std::size_t i = 0; i < d->scores.size() && i < app.backgrounds.size(); i++) {
+        if (i == d->base || std::isnan(d->scores[i])) continue;
+        // Placement making the background's pixels land where the warp sends the base's.
+        double bg_to_base[6], bg_to_canvas[6];
+        if (!AffineInvert(d->warps[i].data(), bg_to_base)) continue;
+        AffineCompose(base_to_canvas, bg_to_base, bg_to_canvas);
+        SetBackgroundFromCanvas(app.backgrounds[i], bg_to_canvas);
+        app.backgrounds[i].alignment_score = d->scores[i];
+        fmt::print("Background {} aligned, correlation {:.3f}.\n", i, d->scores[i]);
+      }
+    });
 }
 
+void
+UpdateLivePhimap(ApplicationState& app) {
+/*
+    Keeps the patch composite in step with the patches, once per frame.
+    Only the union of the old and new footprints of the patches that moved,
+    were resized or were added is composited again, with every patch
+    overlapping it in draw order.
+*/
+  LivePhimap& live = app.phimap_live;
+  if (!live.active || !app.phimap.data) return;
+  if (live.base != app.segmentation_base || live.base >= app.backgrounds.size()) {
+    live.active = false;
+    return;
+  }
+  if (TilePyramidBusy(app.phimap_pyr)) return; // Next frame
+  PhiMap & bg = app.backgrounds[live.base];
+  auto layers = PhimapLayers(app.images, bg, app.global_scale, app.global_angle, app.phimap.width, app.phimap.height);
+  Rectangle dirty = {0};
+  for (std::size_t i = 0; i < layers.size() || i < live.footprints.size(); i++) {
+    Rectangle now = i < layers.size() ? CompositeLayerBounds(layers[i]) : (Rectangle) {0};
+    Rectangle was = i < live.footprints.size() ? live.footprints[i] : (Rectangle) {0};
+    if (now.x == was.x && now.y == was.y && now.width == was.width && now.height == was.height) continue;
+    dirty = CompositeUnion(dirty, CompositeUnion(was, now));
+  }
+  if (dirty.width <= 0) return;
+  PROFILE_SCOPE("phimap update");
+  live.footprints.clear();
+  for (auto & layer : layers) live.footprints.push_back(CompositeLayerBounds(layer));
+  CompositeLayers(app.phimap, layers, dirty, WHITE, COMPOSITE_AREA);
+  TilePyramidUpdate(app.phimap_pyr, dirty);
+}
 
 void FileDialogAction(int action, GuiFileDialogState& fileDialogState, ApplicationState& app) {
     char fileNameToLoad[512] = { 0 };
@@ -417,7 +1556,6 @@ void FileDialogAction(int action, GuiFileDialogState& fileDialogState, Applicati
         fmt::print("Opening {}\n", fileDialogState.fileNameText);
         strcpy(fileNameToLoad, TextFormat("%s/%s", fileDialogState.dirPathText, fileDialogState.fileNameText));
         LoadAll(fileNameToLoad, app);
-        app.file_loaded=1;
         break;
       }
       case 1: {
@@ -435,7 +1573,7 @@ void FileDialogAction(int action, GuiFileDialogState& fileDialogState, Applicati
         int cur_size = app.images.size();
         for (int i = 0; i < files.count; i++) {
           fmt::print("{}\n", files.paths[i]);
-          app.images.push_back(LoadPhiMap(files.paths[i], cur_size+i, (float)i*app.global_scale, app.folder));
+          app.images.push_back(LoadPhiMap(files.paths[i], cur_size+i, app.atlas, (float)i*app.global_scale, app.folder));
         }
         break;
       }
@@ -443,19 +1581,10 @@ void FileDialogAction(int action, GuiFileDialogState& fileDialogState, Applicati
       {
         strcpy(fileNameToLoad, TextFormat("%s/%s", fileDialogState.dirPathText, fileDialogState.fileNameText));
         fmt::print("Loading background {}", fileNameToLoad); 
-        Image bg = LoadImage(fileNameToLoad);
+        app.backgrounds.push_back(LoadBackground(LoadBackgroundImage(fileNameToLoad), fileNameToLoad, 0.f, 0.f, 6.f, 6.f, 0));
+        Image& bg = app.backgrounds.back().image;
         float aspect_ratio = (float) bg.width / (float) bg.height;
-
-        app.backgrounds.push_back(PhiMap(
-            0.f,0.f,
-            aspect_ratio * 6.f,6.0f,
-          0, LoadTextureFromImage(bg),
-          false, false, 0
-        ));
-        app.backgrounds.back().filename = fileNameToLoad;
-        int count = 0;
-        const char ** extension = TextSplit(GetFileName(app.backgrounds.back().filename.c_str()), '.', &count);
-        app.backgrounds.back().type =  fmt::format("{}", extension[1]);
+        app.backgrounds.back().w = aspect_ratio * 6.f;
         arrput(app.backgrounds_alpha, 0.5);
         break;
       }
@@ -463,34 +1592,60 @@ void FileDialogAction(int action, GuiFileDialogState& fileDialogState, Applicati
     fileDialogState.SelectFilePressed = false;
 }
 
-void
-UpdateBoundariesDisplay(ApplicationState & app, int segmentation, int image) {
-  UnloadImage(app.steps[image]);
-  UnloadTexture(app.steps_tex[image]);
-  if (app.phimap.data ==nullptr) fmt::print("Warning: phimap [p] was not computed\n");
-  if (app.show_segmentation) {
-    if (app.use_phi &&app.phimap.data !=nullptr)  {
-      app.steps[image] = MarkBoundaries(app.phimap, app.segmentations[segmentation], app.boundaries_color);
-    }
-    else {
-      app.steps[image] = MarkBoundaries(app.steps[0], app.segmentations[segmentation], app.boundaries_color);
-    }
+int
+HeadlessPhimap(std::string project_file, std::string out_file, int mul) {
+/*
+    Composites the phimap of a saved project without opening a window, at
+    mul times the resolution of the first background, into a PNG or a tile
+    pyramid (see tile_export.h). The label buffers (.bin) are not read.
+*/
+  ProjectData project;
+  JobProgress progress;
+  ReadProject(project_file, project, progress, false);
+  json& data = project.data;
+  if (project.backgrounds.empty()) {
+    fmt::print("{} has no background to composite over.\n", project_file);
+    return 1;
   }
-  else {
-    if (app.use_phi && app.phimap.data !=nullptr) {
-      app.steps[image] = ImageCopy(app.phimap);
-    } else {
-      app.steps[image] = ImageCopy(app.steps[0]);
-    }
+  std::vector<PhiMap> patches;
+  for (int i = 0; i < data["patches"].size(); i++) {
+    auto d = data["patches"][i];
+    patches.push_back(PhiMap(d["x"], d["y"], d["w"], d["h"], d["r"], (Texture2D) {0}, false, false, i));
+    patches.back().image = project.patches[i];
+  }
+  auto e = data["backgrounds"][0];
+  PhiMap bg = PhiMap(e["x"], e["y"], e["w"], e["h"], e["r"], (Texture2D) {0}, false, false, 0);
+  bg.image = project.backgrounds[0];
+  int px = mul * bg.image.width, py = mul * bg.image.height;
+  auto layers = PhimapLayers(patches, bg, data["global"]["scale"], data["global"]["angle"], px, py);
+  fmt::print("Writing {} ({} x {}, {} patches).\n", out_file, px, py, layers.size());
+  // Anything but a .png is a directory for a tile pyramid, composited tile by tile.
+  if (!IsFileExtension(out_file.c_str(), ".png")) {
+    return ExportTiles(px, py, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, TilesFromLayers(layers, WHITE, COMPOSITE_AREA), out_file) ? 0 : 1;
   }
-  app.steps_tex[image] = LoadTextureFromImage(app.steps[image]);
+  Image out = (Image) {malloc((std::size_t) px * py * 4), px, py, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+  assert(out.data);
+  CompositeLayers(out, layers, (Rectangle) {0, 0, (float) px, (float) py}, WHITE, COMPOSITE_AREA);
+  bool ok = ExportImage(out, out_file.c_str());
+  UnloadImage(out);
+  return ok ? 0 : 1;
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
     Image denoised;
     const int screenWidth = 1200;
     const int screenHeight = 720;
+    cv::setNumThreads(0); // OpenCV calls run inside pool tasks, see pool.h
+    TraceSetThreadName("main");
+    if (argc > 1 && strcmp(argv[1], "--phimap") == 0) {
+      // stitcher --phimap project.json [out.png | out_dir] [resolution multiplier]
+      if (argc < 3) {
+        fmt::print("Usage: {} --phimap project.json [out.png | out_dir] [multiplier]\n", argv[0]);
+        return 1;
+      }
+      return HeadlessPhimap(argv[2], argc > 3 ? argv[3] : "phimap_new.png", argc > 4 ? atoi(argv[4]) : 1);
+    }
 
 
     Camera2D camera = { 0 };
@@ -508,11 +1663,11 @@ int main(void)
 
     ApplicationState app;
     if (!app.steps_initialized) {
-       for (int i = 0; i < 5; i++)
+       for (int i = 0; i < 2; i++)
        {
           app.steps[i] = GenImageColor(10,10, (Color){(unsigned char)(50*i), 0,0,255 });
           ImageDrawRectangleLines(&app.steps[i], (Rectangle) {1,1,8,8}, 1, WHITE);
-          app.steps_tex[i] = LoadTextureFromImage(app.steps[i]);
+          app.steps_pyr[i] = TilePyramidCreate(app.steps[i]);
        }
        app.steps_initialized = true;
     }
@@ -521,12 +1676,19 @@ int main(void)
 
     while (!WindowShouldClose())
     {
+        ProfileTimer update_timer(PROFILE_STAGE("frame update"));
         auto mp = GetMousePosition();
         auto wmp = GetScreenToWorld2D(mp, camera);
         app.hovering_menus = 
              CheckCollisionPointRec(mp, app.params_rect)
+          || CheckCollisionPointRec(mp, app.jobs_rect)
           || mp.y >= screenHeight-20;
 
+        JobsUpdate(app.jobs);
+        UpdateAutosave(app);
+        if (IsKeyPressed(KEY_F1)) GetProfiler().visible = !GetProfiler().visible;
+        if (IsKeyPressed(KEY_F2)) SubmitTraceExport(app, "trace.json");
+        if (IsKeyPressed(KEY_F3)) SubmitTileExport(app);
         if (IsKeyPressed(KEY_TAB)) {
           app.mode = app.mode == AppMode::Stitching ? AppMode::Segmenting : AppMode::Stitching;
         }
@@ -536,6 +1698,7 @@ int main(void)
           if (app.mode == AppMode::Stitching) {
             if (IsKeyPressed(KEY_X)) app.background_edit = !app.background_edit;
             if (IsKeyPressed(KEY_B)) app.background_cur = (app.background_cur + 1) % app.backgrounds.size();
+            if (IsKeyPressed(KEY_E) && app.background_edit) SubmitBackgroundAlignment(app);
             
 
             if (!app.background_edit) {
@@ -563,90 +1726,25 @@ int main(void)
               else if (IsKeyDown(KEY_T)) target.rotation_deg-=0.05;
             }
             if (IsKeyPressed(KEY_P) && app.segmentation_base < app.backgrounds.size()) {
-              // Locate the background used as base for segmentation
-              PhiMap & bg = app.backgrounds[app.segmentation_base];
-              float x0=bg.x, y0=bg.y, w0=bg.w, h0 = bg.h;
-              int mul = 1;
-              if (IsKeyDown(KEY_LEFT_SHIFT)) mul = 4;
-              int px = mul * bg.tex.width, py=mul * bg.tex.height;
-              // Generate and save the phimap
-              RenderTexture2D rt = LoadRenderTexture(px, py);
-              BeginTextureMode(rt);
-              ClearBackground(WHITE);
-              for(int i = 0; i < app.images.size(); i++) {
-                PhiMap im = app.images[i];
-                Rectangle dest = {(float) px*(im.x-x0)/w0, (float) py*(im.y-y0)/h0, (float) px*im.w*2*app.global_scale/w0, (float) py*im.h*2*app.global_scale/h0};
-                DrawTexturePro(im.tex, {0.f, 0.f, (float) im.tex.width, (float) im.tex.height}, dest, {0.f,0.f}, app.global_angle, WHITE);
-              }
-              EndTextureMode();
-              if (app.phimap.data == nullptr)
-                app.phimap = LoadImageFromTexture(rt.texture);
-              else
-                UnloadImage(app.phimap);
-                app.phimap = LoadImageFromTexture(rt.texture);
-              ImageFlipVertical(&app.phimap);
-              ExportImage(app.phimap, "phimap_new.png");
-              UnloadRenderTexture(rt);
+              SubmitPhimapComposite(app, IsKeyDown(KEY_LEFT_SHIFT) ? 4 : 1, false);
             }
             if (IsKeyPressed(KEY_G) && app.segmentation_base < app.backgrounds.size()) {
-              // Locate the background used as base for segmentation
-              PhiMap & bg = app.backgrounds[app.segmentation_base];
-              float x0=bg.x, y0=bg.y, w0=bg.w, h0 = bg.h;
-              int mul = 1;
-              if (IsKeyDown(KEY_LEFT_SHIFT)) mul = 4;
-              int px = mul * bg.tex.width, py=mul * bg.tex.height;
-              // Generate and save the phimap
-              RenderTexture2D rt = LoadRenderTexture(px, py);
-              BeginTextureMode(rt);
-              ClearBackground(BLACK);
-              Color bgcolors[3];
-              bgcolors[0] = {255,0,0,255};
-              bgcolors[1] = {0,255,0,128};
-              bgcolors[2] = {0,0,255, 85};
-              for(int i = 0; i < app.backgrounds.size(); i++) {
-                PhiMap im = app.backgrounds[i];
-                Rectangle dest = {(float) px*(im.x-x0)/w0, (float) py*(im.y-y0)/h0, (float) px*im.w*2*app.global_scale/w0, (float) py*im.h*2*app.global_scale/h0};
-                Image bg1 = LoadImageFromTexture(im.tex);
-                ImageColorGrayscale(&bg1);
-                Texture2D bg1tex = LoadTextureFromImage(bg1);
-                DrawTexturePro(bg1tex, {0.f, 0.f, (float) im.tex.width, (float) im.tex.height}, dest, {0.f,0.f}, im.rotation_deg, bgcolors[i]);
-              }
-              EndTextureMode();
-              if (app.phimap.data == nullptr)
-                app.phimap = LoadImageFromTexture(rt.texture);
-              else {
-                UnloadImage(app.phimap);
-                app.phimap = LoadImageFromTexture(rt.texture);
-              }
-              unsigned char maxval[3] = {0,0,0};
-              for(int i = 0; i < app.phimap.width*app.phimap.height; i++) {
-                for (int j = 0; j < 3; j++) {
-                  int cur = ((unsigned char*) app.phimap.data)[i*4+j];
-                  maxval[j] = cur > maxval[j] ? cur : maxval[j];
-                }
-              }
-              printf("Maxvals %d %d %d\n", maxval[0], maxval[1], maxval[2]);
-              for(int i = 0; i < app.phimap.width*app.phimap.height; i++) {
-                for (int j = 0; j < 3; j++) {
-                  unsigned char& cur = ((unsigned char*) app.phimap.data)[i*4+j];
-                  cur = round((255 * cur) / (float) maxval[j]) ;
-                }
-                unsigned char& cur = ((unsigned char*) app.phimap.data)[i*4+3];
-                cur = 255;
-              }
-              printf("Image format: %d\n", app.phimap.format);
-              ImageFlipVertical(&app.phimap);
-              ExportImage(app.phimap, "compound_background.png");
-              UnloadRenderTexture(rt);
+              SubmitPhimapComposite(app, IsKeyDown(KEY_LEFT_SHIFT) ? 4 : 1, true);
             }
+            if (IsKeyPressed(KEY_A) && app.segmentation_base < app.backgrounds.size()) {
+              SubmitPatchRegistration(app, IsKeyDown(KEY_LEFT_SHIFT));
+            }
+            if (IsKeyPressed(KEY_F)) SubmitPatchRefinement(app);
             // Objects under left-clicked cursor are mouse-bound.
             // We also register the position relative to the cursor.
             // This is more stable for moving objects around than using mouse delta
             if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT))
             {
              
-              for(int i = 0; i < app.images.size(); i++) {
-                auto im = app.images[i];
+              UpdatePatchGrid(app);
+              PatchGridQuery(app.patch_grid, (Rectangle) {wmp.x, wmp.y, 0, 0}, app.patches_found);
+              for(int i : app.patches_found) {
+                auto& im = app.images[i];
                 if(CheckCollisionPointRec(wmp, GetPhiMapRectangle(im, app.global_scale))) {
                   app.images[i].selected = !app.images[i].selected;
                   app.images[i].mouse_bound = true;
@@ -667,7 +1765,7 @@ int main(void)
 
             // Link mouse-bound objects positions to mouse position
             for(int i = 0; i < app.images.size(); i++) {
-                auto im = app.images[i];
+                auto& im = app.images[i];
                 if(im.mouse_bound)
                 {
                   auto mp = GetMousePosition();
@@ -677,6 +1775,8 @@ int main(void)
                   op = GetScreenToWorld2D(op, camera);
                   app.images[i].x = op.x;
                   app.images[i].y = op.y;
+                  UpdatePatchGrid(app);
+                  PatchGridMove(app.patch_grid, i, GetPhiMapBounds(im, app.global_scale, app.global_angle));
                 }
             } // Bound-move
             if (app.background_edit && app.background_cur < app.backgrounds.size() && IsMouseButtonDown(MOUSE_BUTTON_LEFT) && !app.hovering_menus)
@@ -693,13 +1793,11 @@ int main(void)
           else if (app.mode == AppMode::Segmenting) {
             if (IsKeyPressed(KEY_V)) {
               app.use_phi = !app.use_phi;
-              app.boundaries_dirty = true;
             }
             if (IsKeyPressed(KEY_C)) {
               app.show_segmentation = !app.show_segmentation;
-              app.boundaries_dirty = true;
             }
-            if (IsKeyPressed(KEY_X)) hmfree(app.selected_labels);
+            if (IsKeyPressed(KEY_X)) ClearSelection(app);
             if (app.shown_step != 0 && app.shown_step != 4) {
               if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT) && IsKeyDown(KEY_LEFT_SHIFT)) {
                 if (CheckCollisionPointCircle((Vector2) {wmp.x, wmp.y}, (Vector2) {app.focus_zone.x, app.focus_zone.y}, 0.1))
@@ -719,49 +1817,42 @@ int main(void)
               // When we look at manual rag
               PhiMap& bg = app.backgrounds[app.segmentation_base];
               if(IsMouseButtonPressed(MOUSE_BUTTON_LEFT) && (IsKeyDown(KEY_LEFT_CONTROL) || !app.drawing_board_active) && CheckCollisionPointRec(wmp, (Rectangle) {bg.x, bg.y, bg.w, bg.h}) && !app.hovering_menus) {
-                int x = round((wmp.x - bg.x) / bg.w * bg.tex.width);
-                int y = round((wmp.y - bg.y) / bg.h * bg.tex.height);
+                int x = round((wmp.x - bg.x) / bg.w * bg.image.width);
+                int y = round((wmp.y - bg.y) / bg.h * bg.image.height);
 
-                std::size_t id = app.segmentations[2][y * bg.tex.width + x];
-                if (hmgeti(app.selected_labels, id) == -1)
+                std::size_t id = app.segmentations[2][y * bg.image.width + x];
+                if (hmgeti(app.metadata_labels, id) == -1) {
+                  SegmentProperties lab = ComputeSegmentProperties(app.segmentations[2], bg.image.width, bg.image.height, id);
+                  hmput(app.metadata_labels, id, lab);
+                }
+                bool selecting = hmgeti(app.selected_labels, id) == -1;
+                if (selecting)
                   hmput(app.selected_labels, id, true);
                 else
                   hmdel(app.selected_labels, id);
-
-                if (hmgeti(app.metadata_labels, id) != -1) {
-                  SegmentProperties& seg = hmget(app.metadata_labels, id);
-                } else {
-                  SegmentProperties lab = ComputeSegmentProperties(app.segmentations[2], bg.tex.width, bg.tex.height, id);
-                  hmput(app.metadata_labels, id, lab);
-                }
+                SelectionLayerSet(app.selection, app.segmentations[2], bg.image.width, bg.image.height, hmget(app.metadata_labels, id), selecting);
               }
               if (app.drawing_board_active && !IsKeyDown(KEY_LEFT_CONTROL)) {
-                if(!app.drawing_board.data) app.drawing_board= GenImageColor(bg.tex.width, bg.tex.height, {0,0,0,0});
-                if (CheckCollisionPointRec(wmp, (Rectangle) {bg.x, bg.y, bg.w, bg.h})&&!app.hovering_menus) {
-                  int x = round((wmp.x - bg.x) / bg.w * bg.tex.width);
-                  int y = round((wmp.y - bg.y) / bg.h * bg.tex.height);
-                  int brush_size = bg.tex.width*app.drawing_board_cursor_size/ 4.0;
-                  #define for_interval(X, MIN, MAX) for(int X = (MIN); X < (MAX); (X)++)
-                  int nsel = hmlen(app.selected_labels);
-                  Color brush_color = app.drawing_board_cursor_mode == CursorMode::Brush ? YELLOW : NOCOLOR;
-                  if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
-                    for_interval(i_, x-brush_size/2, x+brush_size/2) {
-                      for_interval(j_, y-brush_size/2, y+brush_size/2) {
-                        if (sqrtf((i_-x)*(i_-x)+(j_-y)*(j_-y)) < brush_size/2) {
-                          if (nsel==0) {
-                            // If no segment is selected, draw
-                            ((Color*)app.drawing_board.data)[j_ * bg.tex.width+ i_] = brush_color;
-                          } else if (hmgeti(app.selected_labels, app.segmentations[2][j_ * bg.tex.width+ i_]) != -1) {
-                            // If one is selected, we only draw on selected pixels.
-                            ((Color*)app.drawing_board.data)[j_ * bg.tex.width+ i_] = brush_color;
-                          }
-                        }
-                      }
-                    }
-                    if (app.drawing_board_tex.id > 0) UnloadTexture(app.drawing_board_tex);
-                    app.drawing_board_tex = LoadTextureFromImage(app.drawing_board);
-                  }
-
+                if (app.strokes.width != bg.image.width || app.strokes.height != bg.image.height) {
+                  StrokeLayerClear(app.strokes);
+                  app.strokes.width = bg.image.width;
+                  app.strokes.height = bg.image.height;
+                }
+                bool on_board = CheckCollisionPointRec(wmp, (Rectangle) {bg.x, bg.y, bg.w, bg.h}) && !app.hovering_menus;
+                if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) && (on_board || app.stroke.drawing)) {
+                  float x = (wmp.x - bg.x) / bg.w * bg.image.width;
+                  float y = (wmp.y - bg.y) / bg.h * bg.image.height;
+                  int brush_size = bg.image.width*app.drawing_board_cursor_size/ 4.0;
+                  bool erase = app.drawing_board_cursor_mode == CursorMode::Eraser;
+                  // If segments are selected, we only draw on their pixels.
+                  std::size_t *labels = app.segmentations[2];
+                  auto *selected = app.selected_labels;
+                  bool restricted = hmlen(selected) > 0;
+                  StrokeTo(app.stroke, app.strokes, x, y, brush_size/2, erase, [&](std::size_t i) {
+                    return !restricted || hmgeti(selected, labels[i]) != -1;
+                  });
+                } else {
+                  StrokeEnd(app.stroke);
                 }
               }
             }
@@ -800,103 +1891,13 @@ int main(void)
             if (app.segmentation_base < app.backgrounds.size()) {
               if (IsKeyPressed(KEY_T)) {
                 PhiMap & bg = app.backgrounds[app.segmentation_base];
-                if (IsKeyDown(KEY_LEFT_SHIFT)) {
-                  UnloadImage(app.steps[0]);
-                  UnloadImage(app.steps[1]);
-                  app.steps[0] = LoadImageFromTexture(bg.tex);
-                  app.steps[1] = ImageCopy(app.steps[0]);
-                  opencv_nlmeans_denoising(app.steps[0], app.steps[1], app.params.kl_strenght, app.params.kl_kernel, app.params.kl_search_window);
-                  UnloadTexture(app.steps_tex[0]);
-                  UnloadTexture(app.steps_tex[1]);
-                  app.steps_tex[0] = LoadTextureFromImage(app.steps[0]);
-                  app.steps_tex[1] = LoadTextureFromImage(app.steps[1]);
-                } else {
-                  float x0 = bg.x, y0 = bg.y, w0 = bg.w,h0 = bg.h;
-                  Rectangle fi = app.focus_zone;
-                  Rectangle focus_pixels = { round((fi.x - x0) / w0 * bg.tex.width), round((fi.y - y0) / h0 * bg.tex.height), round(fi.width/w0*bg.tex.width), round(fi.height/h0*bg.tex.height)};
-                  Image crop = ImageFromImage(app.steps[0], focus_pixels);
-                  Image dcrop = ImageCopy(crop);
-                  opencv_nlmeans_denoising(crop, dcrop, app.params.kl_strenght, app.params.kl_kernel, app.params.kl_search_window);
-                  DrawImageOnImage(app.steps[1], dcrop, focus_pixels);
-                  UnloadTexture(app.steps_tex[1]);
-                  app.steps_tex[1] = LoadTextureFromImage(app.steps[1]);
-                }
+                SubmitDenoising(app, IsKeyDown(KEY_LEFT_SHIFT), FocusPixels(app, bg.image));
               }
               if (IsKeyPressed(KEY_Y)) {
-                EnsureWellAllocatedSegments(app);
-                PhiMap & bg = app.backgrounds[app.segmentation_base];
-                Image& start = app.steps[1];
-                int length = start.height*start.width;
-                if (IsKeyDown(KEY_LEFT_SHIFT)) {
-                  quickshift(start, app.params.qs_kernel_size, app.params.qs_max_size, app.segmentations[0], app.params.qs_ratio);
-                  auto offset = current_max_label(app, 0);
-                  relabel_sequential(app.segmentations[0], length, offset);
-                  relabel_sequential_global(app.segmentations, length);
-                  UpdateBoundariesDisplay(app, 0, 2);
-                } else {
-                  float x0 = bg.x, y0 = bg.y, w0 = bg.w,h0 = bg.h;
-                  Rectangle fi = app.focus_zone;
-                  Rectangle focus_pixels = { round((fi.x - x0) / w0 * start.width), round((fi.y - y0) / h0 * start.height), round(fi.width/w0*start.width), round(fi.height/h0*start.height)};
-                  Image crop = ImageFromImage(app.steps[0], focus_pixels);
-                  std::size_t *cropseg = (std::size_t*) malloc(focus_pixels.width*focus_pixels.height*sizeof(std::size_t));
-                  quickshift(crop, app.params.qs_kernel_size, app.params.qs_max_size, cropseg, app.params.qs_ratio);
-                  auto offset = current_max_label(app);
-                  relabel_sequential(cropseg, crop.width*crop.height, offset);
-                  DrawImageOnImageL(app.segmentations[0], cropseg, focus_pixels, start.width, start.height, 0);
-                  UnloadImage(crop);
-                  free(cropseg);
-
-                }
-                relabel_sequential_global(app.segmentations, length);
-                UpdateBoundariesDisplay(app, 0, 2);
+                SubmitQuickshift(app, IsKeyDown(KEY_LEFT_SHIFT), FocusPixels(app, app.steps[1]));
               }
               if (IsKeyPressed(KEY_U) ) {
-                EnsureWellAllocatedSegments(app);
-                Image& start = app.steps[1];
-                if (IsKeyDown(KEY_LEFT_SHIFT)) {
-                  int length = start.height*start.width;
-                  memcpy(app.segmentations[1], app.segmentations[0], length*sizeof(std::size_t));
-                  std::size_t *labels = app.segmentations[1];
-                  std::size_t num_components = maximum_label(labels, length) + 1;
-                  rag r = rag_create(num_components);
-                  rag_adjacency_matrix(r, labels, start.width, start.height);
-
-                  float *im_float = uint8_to_float((uint8_t*)start.data, length, 4, 3);
-                  rag_color_distance_matrix(r, im_float, labels, start.width, start.height);
-                  free(im_float);
-
-                  rag_merge(r, app.params.rag_threshold);
-                  rag_relabel(r, labels, length);
-                } else {
-                  PhiMap & bg = app.backgrounds[app.segmentation_base];
-                  float x0 = bg.x, y0 = bg.y, w0 = bg.w,h0 = bg.h;
-                  Rectangle fi = app.focus_zone;
-                  Rectangle focus_pixels = { round((fi.x - x0) / w0 * start.width), round((fi.y - y0) / h0 * start.height), round(fi.width/w0*start.width), round(fi.height/h0*start.height)};
-                  std::size_t * crop = ImageFromImageL(app.segmentations[0], focus_pixels, start.width, start.height);
-                  Image imcrop = ImageFromImage(app.steps[0], focus_pixels);
-                  std::size_t width = focus_pixels.width;
-                  std::size_t height = focus_pixels.height;
-                  std::size_t length = height*width;
-                  std::size_t num_components = maximum_label(crop, length) + 1;
-                  rag r = rag_create(num_components);
-                  rag_adjacency_matrix(r, crop, width, height);
-
-                  float *im_float = uint8_to_float((uint8_t*)imcrop.data, length, 4, 3);
-                  rag_color_distance_matrix(r, im_float, crop, width, height);
-                  free(im_float);
-
-                  rag_merge(r, app.params.rag_threshold);
-                  rag_relabel(r, crop, length);
-
-                  //auto offset = current_max_label(app);
-                  
-                  DrawImageOnImageL(app.segmentations[1], crop, focus_pixels, start.width, start.height, 0);
-                  free(crop);
-                  UnloadImage(imcrop);
-                }
-                hmfree(app.metadata_labels);
-                hmfree(app.selected_labels);
-                UpdateBoundariesDisplay(app, 1, 3);
+                SubmitRegionAdjacency(app, IsKeyDown(KEY_LEFT_SHIFT), FocusPixels(app, app.steps[1]));
               }
               //if (IsKeyPressed(KEY_O)) {
               //  EnsureWellAllocatedSegments(app);
@@ -916,6 +1917,7 @@ int main(void)
                 if (IsKeyDown(KEY_LEFT_SHIFT)) {
                   int length = start.height*start.width;
                   memcpy(app.segmentations[2], app.segmentations[1], length*sizeof(std::size_t));
+                  MarkLabelsDirty(app, 2, {0, 0, (float) start.width, (float) start.height});
                 } else {
                   PhiMap & bg = app.backgrounds[app.segmentation_base];
                   float x0 = bg.x, y0 = bg.y, w0 = bg.w,h0 = bg.h;
@@ -927,44 +1929,69 @@ int main(void)
                   std::size_t length = height*width;
                   DrawImageOnImageL(app.segmentations[2], crop, focus_pixels, start.width, start.height, 0);
                   free(crop);
+                  MarkLabelsDirty(app, 2, focus_pixels);
                 }
-                hmfree(app.metadata_labels);
-                hmfree(app.selected_labels);
-                UpdateBoundariesDisplay(app, 2, 4);
+                app.label_undo.clear();
+                ClearSelection(app);
               }
-              if (IsKeyPressed(KEY_B) && IsKeyDown(KEY_LEFT_SHIFT)) {
+              if (IsKeyPressed(KEY_B) && IsKeyDown(KEY_LEFT_SHIFT) && app.strokes.width == app.steps[0].width && app.strokes.height == app.steps[0].height) {
+                // Strokes become one new segment, only covered pixels are visited.
                 EnsureWellAllocatedSegments(app);
-                Image& start = app.steps[0];
                 auto current_max = current_max_label(app);
-                for_range(i, start.height*start.width) {
-                  if (((Color*)app.drawing_board.data)[i].r == YELLOW.r) {
-                    app.segmentations[2][i] = current_max + 1;
-                    ((Color*)app.drawing_board.data)[i] = {0,0,0,0};
-                  }
+                std::size_t *labels = app.segmentations[2];
+                LabelUndo undo;
+                undo.segmentation = 2;
+                undo.bbox = StrokeLayerForEach(app.strokes, [&](std::size_t i) {
+                  undo.pixels.push_back(i);
+                  undo.labels.push_back(labels[i]);
+                  labels[i] = current_max + 1;
+                });
+                StrokeLayerClear(app.strokes);
+                if (!undo.pixels.empty()) {
+                  SplitDisconnectedSegments(app, 2, &undo);
+                  MarkLabelsDirty(app, 2, undo.bbox);
+                  PushLabelUndo(app, undo);
                 }
-                if (app.drawing_board_tex.id > 0) UnloadTexture(app.drawing_board_tex);
-                app.drawing_board_tex = LoadTextureFromImage(app.drawing_board);
-                app.boundaries_dirty = true;
-                hmfree(app.metadata_labels);
-                hmfree(app.selected_labels);
+                ClearSelection(app);
               }
               if (IsKeyPressed(KEY_J) && IsKeyDown(KEY_LEFT_SHIFT) && hmlen(app.selected_labels) > 1) {
                 Image& start = app.steps[0];
                 std::size_t master_id = app.selected_labels[0].key;
+                LabelUndo undo;
+                undo.segmentation = 2;
+                int xmin = start.width, ymin = start.height, xmax = -1, ymax = -1;
                 for_range(i, start.height*start.width) {
-                  if (hmgeti(app.selected_labels, app.segmentations[2][i]) != -1) {
+                  if (app.segmentations[2][i] != master_id && hmgeti(app.selected_labels, app.segmentations[2][i]) != -1) {
+                    undo.pixels.push_back(i);
+                    undo.labels.push_back(app.segmentations[2][i]);
                     app.segmentations[2][i] = master_id;
+                    int x = i % start.width, y = i / start.width;
+                    xmin = x < xmin ? x : xmin; xmax = x > xmax ? x : xmax;
+                    ymin = y < ymin ? y : ymin; ymax = y > ymax ? y : ymax;
                   }
                 }
-                app.boundaries_dirty = true;
-                hmfree(app.metadata_labels);
-                hmfree(app.selected_labels);
+                SplitDisconnectedSegments(app, 2, &undo);
+                if (xmax >= 0) {
+                  undo.bbox = {(float) xmin, (float) ymin, (float) (xmax-xmin+1), (float) (ymax-ymin+1)};
+                  MarkLabelsDirty(app, 2, undo.bbox);
+                }
+                PushLabelUndo(app, undo);
+                ClearSelection(app);
+              }
+              if (IsKeyPressed(KEY_Z) && IsKeyDown(KEY_LEFT_CONTROL) && !app.label_undo.empty()) {
+                UndoLabelEdit(app);
+                ClearSelection(app);
               }
-              if (app.boundaries_dirty) {
-                UpdateBoundariesDisplay(app, 0, 2);
-                UpdateBoundariesDisplay(app, 1, 3);
-                UpdateBoundariesDisplay(app, 2, 4);
-                app.boundaries_dirty = false;
+              if (IsKeyPressed(KEY_H) && app.segmentations[2]) {
+                // Per-grain phimap statistics on the manual segmentation
+                SubmitPhimapStatistics(app);
+              }
+              for_range(i, 3) {
+                // Segmentation i is displayed by step i+2
+                if (app.segmentations[i] && app.labels_dirty[i].width > 0 && app.labels_dirty[i].height > 0) {
+                  BoundaryLayerUpdate(app.boundaries[i], app.segmentations[i], app.steps[0].width, app.steps[0].height, app.labels_dirty[i]);
+                  app.labels_dirty[i] = {0};
+                }
               }
             } // Has a segmentation base image
 
@@ -996,11 +2023,14 @@ int main(void)
             camera.target = GetScreenToWorld2D(tp, camera);
           } // Canvas Move
         }
+        UpdateLivePhimap(app);
         /** ----------- *
          *    Drawing
          *  ----------- */
         
+        update_timer.Stop();
         BeginDrawing();
+          ProfileTimer draw_timer(PROFILE_STAGE("frame draw"));
           BeginMode2D(camera);
             ClearBackground(RAYWHITE);
             if(app.mode == AppMode::Stitching) {
@@ -1009,25 +2039,32 @@ int main(void)
                 color = {255,255,255, 128};
                 for (int i = 0; i < app.backgrounds.size(); i++) {
                   PhiMap& target = app.backgrounds[i];
-                  DrawTexturePro(target.tex, {0.f, 0.f, (float) target.tex.width, (float) target.tex.height}, {target.x, target.y, target.w, target.h}, {0.f,0.f}, target.rotation_deg, {255,255,255, (uint8_t) (255*app.backgrounds_alpha[i])});
+                  DrawTilePyramid(target.pyramid, {target.x, target.y, target.w, target.h}, target.rotation_deg, {255,255,255, (uint8_t) (255*app.backgrounds_alpha[i])}, camera);
                 }
                 PhiMap& target = app.backgrounds[app.background_cur];
                 DrawRectangleLinesEx((Rectangle) {target.x, target.y, target.w, target.h}, 0.05, RED);
               }
               else if (app.background_cur < app.backgrounds.size()) {
                 PhiMap& bg = app.backgrounds[app.background_cur];
-                DrawTexturePro(bg.tex, {0.f, 0.f, (float) bg.tex.width, (float) bg.tex.height}, {bg.x, bg.y, bg.w, bg.h}, {0.f,0.f}, bg.rotation_deg, color);
+                DrawTilePyramid(bg.pyramid, {bg.x, bg.y, bg.w, bg.h}, bg.rotation_deg, color, camera);
               }
               if (!app.background_edit) {
-                for(int i = 0; i < app.images.size(); i++) {
-                  PhiMap im = app.images[i];
+                // Only the patches in view.
+                Vector2 view0 = GetScreenToWorld2D((Vector2) {0, 0}, camera);
+                Vector2 view1 = GetScreenToWorld2D((Vector2) {(float) GetScreenWidth(), (float) GetScreenHeight()}, camera);
+                UpdatePatchGrid(app);
+                PatchGridQuery(app.patch_grid, (Rectangle) {view0.x, view0.y, view1.x - view0.x, view1.y - view0.y}, app.patches_found);
+                for(int i : app.patches_found) {
+                  PhiMap& im = app.images[i];
                   Rectangle dest = {(float) im.x, (float) im.y, (float) im.w*2*app.global_scale, (float) im.h*2*app.global_scale};
-                  DrawTexturePro(im.tex, {0.f, 0.f, (float) im.tex.width, (float) im.tex.height}, dest, {0.f,0.f}, app.global_angle, (Color) {255,255,255, (uint8_t)(255*app.phimaps_alpha)});
+                  DrawTexturePro(im.tex, im.src, dest, {0.f,0.f}, app.global_angle, (Color) {255,255,255, (uint8_t)(255*app.phimaps_alpha)});
                 }
               }
             } // AppMode::Stitching
             else if (app.mode == AppMode::Segmenting) {
-              Texture2D& tex = app.steps_tex[app.shown_step];
+              // Steps 2 to 4 are the base image (or the phimap) under the boundaries of segmentation step-2
+              bool boundaries_step = app.shown_step >= 2;
+              TilePyramid *base = !boundaries_step ? StepPyramid(app, app.shown_step) : (app.use_phi && app.phimap_pyr ? app.phimap_pyr : StepPyramid(app, 0));
               Rectangle dest = { 0, 0, 6,6};
               if (app.segmentation_base < app.backgrounds.size()) {
                 PhiMap& bg = app.backgrounds[app.segmentation_base];
@@ -1035,28 +2072,17 @@ int main(void)
                 dest.y = bg.y;
                 dest.width = bg.w;
                 dest.height = bg.h;
-                DrawTexturePro(tex, (Rectangle) {0,0,(float)tex.width, (float)tex.height}, dest, (Vector2) {0,0}, 0, WHITE );
-                for_range(i, hmlen(app.selected_labels)) {
-                  auto id = app.selected_labels[i].key;
-                  auto e = hmget(app.metadata_labels, id);
-                  Rectangle bbox= e.bbox;
-                  Vector2 wcentroid = { (e.centroid.x / bg.tex.width) * bg.w + bg.x, (e.centroid.y / bg.tex.height) * bg.h + bg.y};
-                  Rectangle bbox_on_canvas = (Rectangle) {
-                    (bbox.x / (float) tex.width) * bg.w + bg.x, 
-                    (bbox.y / (float) tex.height) * bg.h + bg.y, 
-                    bbox.width / (float) tex.width * bg.w,
-                    bbox.height / (float) tex.height * bg.h,
-                    };
-                  DrawTexturePro(e.blob_tex, (Rectangle) {0,0, (float) e.blob_tex.width, (float) e.blob_tex.height}, bbox_on_canvas, (Vector2) {0,0}, 0, WHITE);
-                  //DrawRectangleLinesEx(bbox_on_canvas, 0.02, BLUE);
+                DrawTilePyramid(base, dest, 0, WHITE, camera);
+                if (boundaries_step && app.show_segmentation) {
+                  DrawTilePyramid(app.boundaries[app.shown_step-2].pyramid, dest, 0, app.boundaries_color, camera);
                 }
+                if (hmlen(app.selected_labels) > 0) DrawSelectionLayer(app.selection, dest, WHITE, camera);
                 if (app.drawing_board_active) {
-                  Texture2D& tt = app.drawing_board_tex;
-                  DrawTexturePro(app.drawing_board_tex, (Rectangle){0,0,(float)tt.width, (float)tt.height}, dest, (Vector2) {0.f,0.f}, 0.f, {255,255,255,128});
+                  DrawStrokeLayer(app.strokes, dest, {YELLOW.r, YELLOW.g, YELLOW.b, 128});
                   if (CheckCollisionPointRec(wmp, (Rectangle) {bg.x, bg.y, bg.w, bg.h})) {
                     DrawCircleV({wmp.x, wmp.y}, app.drawing_board_cursor_size, {255,200,200,100});
-                    int x = round((wmp.x - bg.x) / bg.w * bg.tex.width);
-                    int y = round((wmp.y - bg.y) / bg.h * bg.tex.height);
+                    int x = round((wmp.x - bg.x) / bg.w * bg.image.width);
+                    int y = round((wmp.y - bg.y) / bg.h * bg.image.height);
                   }
                 }
               } // Has background
@@ -1067,6 +2093,15 @@ int main(void)
           DrawGuidingLines(BLACK, camera); 
           
           EndMode2D();
+          if (app.mode == AppMode::Stitching && !app.background_edit) {
+            // Registration scores [a], low ones in red for a manual fix.
+            for (int i : app.patches_found) {
+              PhiMap& im = app.images[i];
+              if (std::isnan(im.registration_score)) continue;
+              Vector2 p = GetWorldToScreen2D((Vector2) {im.x, im.y}, camera);
+              DrawText(TextFormat("%.2f", im.registration_score), p.x + 2, p.y + 2, 10, im.registration_score < REGISTRATION_MIN_SCORE ? RED : DARKGREEN);
+            }
+          }
 
           /*
            * Start GUI Definition
@@ -1096,6 +2131,7 @@ int main(void)
             fileDialogState.windowActive = true;
             action = 3;
           }
+          app.jobs_rect = GuiJobs(app.jobs, 0, 35);
           app.mode = (AppMode) GuiComboBox((Rectangle){ screenWidth-140, 0, 140, 30 }, "stitching;segmenting", app.mode);
           if (app.background_cur < app.backgrounds.size()) DrawText(GetFileNameWithoutExt(app.backgrounds[app.background_cur].filename.c_str()), 5*screenWidth/8,7*screenHeight/8, 20, RED);
           Rectangle wp = {100,100, 500, 500};
@@ -1140,12 +2176,9 @@ int main(void)
             GuiGroupBox((Rectangle) {x_start+10, y_start+180, w_sliders+110, 30}, "Region Adjacency [u]");
             PARAM_SLIDER(app.params.rag_threshold, y_start+190, "RAG thr.", 0.0f, 0.2f);
             
-            bool old = app.gui_toggle_active;
             app.gui_toggle_active = GuiToggle((Rectangle) {x_sliders, y_start+215, 100,10}, "Boundaries Color", app.gui_toggle_active);
             if (app.gui_toggle_active) {
               app.boundaries_color = GuiColorPicker((Rectangle) {screenWidth-500, screenHeight-200, 120,120}, "", app.boundaries_color);
-            } else if (old != app.gui_toggle_active) {
-              app.boundaries_dirty = true;
             }
 
             GuiGroupBox((Rectangle) {x_start+10, y_start+230, w_sliders+110, 30}, "Drawing []");
@@ -1164,9 +2197,14 @@ int main(void)
             DrawText(fmt::format("Selected {}", app.selected_labels[i].key).c_str(), GetScreenWidth()-100, 40 + i, 12, BLACK);
           GuiUnlock();
           GuiFileDialog(&fileDialogState);
+          draw_timer.Stop();
+          if (GetProfiler().visible) DrawProfileOverlay(GetScreenWidth() - 420, 35);
 
         EndDrawing();
+        ProfileFrameEnd();
+        TilePyramidsFrameEnd();
     } // Main loop
+    JobsShutdown(app.jobs);
     CloseWindow();                // Close window and OpenGL context
     return 0;
 }
@@ -0,0 +1,108 @@
+// Uniform grid over the patch bounds, for picking and view culling.
+//
+// Cells are about the size of an average patch and stored sparsely in a hash
+// map, so the grid needs no extent and patches can be dragged anywhere. A
+// query only visits the cells under the area, so its cost follows what is on
+// screen (or under the cursor), not the number of patches.
+
+struct PatchGrid {
+    float cell = 1.f;                          // World units per cell
+    std::unordered_map<uint64_t, std::vector<int>> cells;
+    std::vector<Rectangle> bounds;             // Indexed bounds of every patch
+    std::vector<unsigned> stamps;              // Last query that reported each patch
+    unsigned query = 0;
+    float scale = NAN, angle = NAN;            // Transform the bounds were computed with
+};
+
+static inline uint64_t
+patch_grid_key(int cx, int cy) {
+    return (uint64_t) (uint32_t) cx << 32 | (uint32_t) cy;
+}
+
+static void
+patch_grid_cells(const PatchGrid& g, Rectangle r, int& cx0, int& cy0, int& cx1, int& cy1) {
+    cx0 = floorf(r.x / g.cell);
+    cy0 = floorf(r.y / g.cell);
+    cx1 = floorf((r.x + r.width) / g.cell);
+    cy1 = floorf((r.y + r.height) / g.cell);
+}
+
+static void
+patch_grid_insert(PatchGrid& g, int id) {
+    int cx0, cy0, cx1, cy1;
+    patch_grid_cells(g, g.bounds[id], cx0, cy0, cx1, cy1);
+    for (int cy = cy0; cy <= cy1; cy++)
+        for (int cx = cx0; cx <= cx1; cx++)
+            g.cells[patch_grid_key(cx, cy)].push_back(id);
+}
+
+static void
+patch_grid_remove(PatchGrid& g, int id) {
+    int cx0, cy0, cx1, cy1;
+    patch_grid_cells(g, g.bounds[id], cx0, cy0, cx1, cy1);
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            auto it = g.cells.find(patch_grid_key(cx, cy));
+            if (it == g.cells.end()) continue;
+            std::vector<int>& ids = it->second;
+            ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+            if (ids.empty()) g.cells.erase(it);
+        }
+    }
+}
+
+void
+PatchGridBuild(PatchGrid& g, const std::vector<Rectangle>& bounds, float scale, float angle) {
+    g.cells.clear();
+    g.bounds = bounds;
+    g.stamps.assign(bounds.size(), 0);
+    g.query = 0;
+    g.scale = scale;
+    g.angle = angle;
+    double extent = 0;
+    for (auto & r : bounds) extent += fmax(r.width, r.height);
+    g.cell = bounds.empty() || extent <= 0 ? 1.f : extent / bounds.size();
+    for (int id = 0; id < (int) bounds.size(); id++) patch_grid_insert(g, id);
+}
+
+void
+PatchGridMove(PatchGrid& g, int id, Rectangle bounds) {
+    patch_grid_remove(g, id);
+    g.bounds[id] = bounds;
+    patch_grid_insert(g, id);
+}
+
+void
+PatchGridQuery(PatchGrid& g, Rectangle area, std::vector<int>& ids) {
+    // Patches whose bounds overlap area, in increasing index order (the draw order).
+    ids.clear();
+    if (++g.query == 0) {
+        std::fill(g.stamps.begin(), g.stamps.end(), 0);
+        g.query = 1;
+    }
+    int cx0, cy0, cx1, cy1;
+    patch_grid_cells(g, area, cx0, cy0, cx1, cy1);
+    if ((int64_t) (cx1 - cx0 + 1) * (cy1 - cy0 + 1) > (int64_t) g.cells.size()) {
+        // Zoomed far out: walking the occupied cells is cheaper than the area.
+        for (auto & cell : g.cells) {
+            for (int id : cell.second) {
+                if (g.stamps[id] == g.query) continue;
+                g.stamps[id] = g.query;
+                if (CheckCollisionRecs(area, g.bounds[id])) ids.push_back(id);
+            }
+        }
+    } else {
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                auto it = g.cells.find(patch_grid_key(cx, cy));
+                if (it == g.cells.end()) continue;
+                for (int id : it->second) {
+                    if (g.stamps[id] == g.query) continue;
+                    g.stamps[id] = g.query;
+                    if (CheckCollisionRecs(area, g.bounds[id])) ids.push_back(id);
+                }
+            }
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+}
@@ -0,0 +1,234 @@
+// Per-segment statistics of the phimap hue, native port of scripts/compute_phimap.py.
+//
+// The hue of every phimap pixel is rounded to 1/180 (like the script) and
+// accumulated in one histogram per segment, in a single pass over the image.
+// Everything else (mode, fill factor, moments, normality test) is derived from
+// the histograms, so the cost no longer depends on the number of segments.
+// Histograms are only kept for the labels present in the segmentation, which
+// are indexed densely first: ids are sparse after a few edits.
+#define PHI_HUE_BINS 181
+
+struct segment_phi_stats {
+    std::size_t id;     // Label of the segment
+    std::size_t area;   // Segment pixels, at phimap resolution
+    std::size_t valid;  // Pixels carrying a phase (not blank)
+    float fill_factor;
+    float mode;         // Hue in [0, 1], NAN when the segment is not filled enough
+    float mean;
+    float variance;
+    float skewness;
+    float kurtosis;     // Pearson's definition (3 for a normal law)
+    float k2;           // D'Agostino-Pearson statistic
+    float pvalue;
+};
+
+static inline int
+phi_hue_bin(const uint8_t *px) {
+    // Blank pixels (white, or transparent) are missing data.
+    if (px[3] == 0 || (px[0] == 255 && px[1] == 255 && px[2] == 255)) return -1;
+    int r = px[0], g = px[1], b = px[2];
+    int max = MAXVAL(r, MAXVAL(g, b));
+    int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+    float delta = max - min;
+    float h = 0.f;
+    if (delta > 0) {
+        if (max == r)      h = (g - b) / delta;
+        else if (max == g) h = (b - r) / delta + 2.f;
+        else               h = (r - g) / delta + 4.f;
+        h /= 6.f;
+        if (h < 0.f) h += 1.f;
+    }
+    return (int) roundf(h * (PHI_HUE_BINS - 1));
+}
+
+static void
+phi_normaltest(segment_phi_stats& s) {
+    // Same formulas as scipy.stats.skewtest, kurtosistest and normaltest.
+    double n = s.valid;
+    s.k2 = s.pvalue = NAN;
+    if (n < 8 || !(s.variance > 0)) return;
+
+    double y = s.skewness * sqrt(((n + 1) * (n + 3)) / (6.0 * (n - 2)));
+    double beta2 = 3.0 * (n*n + 27*n - 70) * (n + 1) * (n + 3) / ((n - 2) * (n + 5) * (n + 7) * (n + 9));
+    double W2 = -1 + sqrt(2 * (beta2 - 1));
+    double delta = 1 / sqrt(0.5 * log(W2));
+    double alpha = sqrt(2.0 / (W2 - 1));
+    if (y == 0) y = 1;
+    double z_skew = delta * log(y / alpha + sqrt((y / alpha) * (y / alpha) + 1));
+
+    double E = 3.0 * (n - 1) / (n + 1);
+    double varb2 = 24.0 * n * (n - 2) * (n - 3) / ((n + 1) * (n + 1) * (n + 3) * (n + 5));
+    double x = (s.kurtosis - E) / sqrt(varb2);
+    double sqrtbeta1 = 6.0 * (n*n - 5*n + 2) / ((n + 7) * (n + 9)) * sqrt((6.0 * (n + 3) * (n + 5)) / (n * (n - 2) * (n - 3)));
+    double A = 6.0 + 8.0 / sqrtbeta1 * (2.0 / sqrtbeta1 + sqrt(1 + 4.0 / (sqrtbeta1 * sqrtbeta1)));
+    double term1 = 1 - 2 / (9.0 * A);
+    double denom = 1 + x * sqrt(2 / (A - 4.0));
+    if (denom == 0) return;
+    double term2 = (denom > 0 ? 1 : -1) * cbrt((1 - 2.0 / A) / fabs(denom));
+    double z_kurt = (term1 - term2) / sqrt(2 / (9.0 * A));
+
+    s.k2 = z_skew * z_skew + z_kurt * z_kurt;
+    s.pvalue = exp(-0.5 * s.k2); // Chi-squared survival function, two degrees of freedom
+}
+
+std::vector<std::size_t>
+segment_ids(const std::size_t *labels, std::size_t n) {
+    // The distinct labels, sorted. Each chunk skips runs and sorts its own ids, then they are merged.
+    std::mutex lock;
+    std::vector<std::size_t> ids;
+    ParallelFor(0, n, 1 << 16, [&](std::size_t lo, std::size_t hi) {
+        std::vector<std::size_t> local;
+        for (std::size_t i = lo; i < hi; i++) if (i == lo || labels[i] != labels[i - 1]) local.push_back(labels[i]);
+        std::sort(local.begin(), local.end());
+        local.erase(std::unique(local.begin(), local.end()), local.end());
+        std::lock_guard<std::mutex> guard(lock);
+        ids.insert(ids.end(), local.begin(), local.end());
+    });
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    return ids;
+}
+
+static inline std::size_t
+segment_index(const segment_phi_stats *stats, std::size_t num_segments, std::size_t label) {
+    // Position of label in stats (sorted by id), num_segments if absent.
+    const segment_phi_stats *it = std::lower_bound(stats, stats + num_segments, label,
+        [](const segment_phi_stats& s, std::size_t id) { return s.id < id; });
+    return it != stats + num_segments && it->id == label ? it - stats : num_segments;
+}
+
+segment_phi_stats *
+phimap_segment_statistics(Image phimap, std::size_t *labels, std::size_t nx, std::size_t ny, std::size_t *num_segments, float min_fill_factor=0.1f) {
+/*
+    Parameters
+    ----------
+    phimap : RGBA image, may be larger than the label map (e.g. 4x render).
+    labels : (ny, nx) segmentation, sampled at the nearest pixel.
+    num_segments : set to the number of distinct labels.
+    min_fill_factor : segments with less phase coverage get NAN statistics.
+    Returns
+    -------
+    Array of *num_segments statistics sorted by id, to be freed by the caller.
+*/
+    assert(phimap.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    PROFILE_SCOPE("phimap statistics");
+    std::size_t pw = phimap.width, ph = phimap.height;
+    std::vector<std::size_t> ids = segment_ids(labels, nx * ny);
+    std::size_t n = ids.size();
+    *num_segments = n;
+    segment_phi_stats *stats = (segment_phi_stats*) calloc(n, sizeof(segment_phi_stats));
+    for (std::size_t i = 0; i < n; i++) stats[i].id = ids[i];
+    uint32_t *histograms = (uint32_t*) calloc(n * PHI_HUE_BINS, sizeof(uint32_t));
+    uint32_t *areas      = (uint32_t*) calloc(n, sizeof(uint32_t));
+    assert(stats && histograms && areas);
+
+    ParallelFor(0, ph, 16, [&](std::size_t lo, std::size_t hi) {
+        // Neighbours mostly share a label: a run is counted locally and added to the shared counts when it ends.
+        std::size_t last = 0, label = segment_index(stats, n, 0);
+        uint32_t run = 0, hist[PHI_HUE_BINS] = {0};
+        int touched[PHI_HUE_BINS], num_touched = 0;
+        auto flush = [&]() {
+            if (run) __atomic_fetch_add(&areas[label], run, __ATOMIC_RELAXED);
+            for (int k = 0; k < num_touched; k++) {
+                int bin = touched[k];
+                __atomic_fetch_add(&histograms[label * PHI_HUE_BINS + bin], hist[bin], __ATOMIC_RELAXED);
+                hist[bin] = 0;
+            }
+            run = num_touched = 0;
+        };
+        for (int py = lo; py < hi; py++) {
+            std::size_t y = py * ny / ph;
+            const uint8_t *row = (const uint8_t*) phimap.data + py * pw * 4;
+            for (std::size_t px = 0; px < pw; px++) {
+                std::size_t id = labels[y * nx + px * nx / pw];
+                if (id != last) {
+                    flush();
+                    label = segment_index(stats, n, last = id);
+                }
+                run++;
+                int bin = phi_hue_bin(row + px * 4);
+                if (bin >= 0 && hist[bin]++ == 0) touched[num_touched++] = bin;
+            }
+        }
+        flush();
+    });
+
+    ParallelFor(0, n, 64, [&](std::size_t lo, std::size_t hi) {
+        for (int i = lo; i < hi; i++) {
+            segment_phi_stats& s = stats[i];
+            const uint32_t *hist = histograms + (std::size_t) i * PHI_HUE_BINS;
+            s.area = areas[i];
+            s.valid = 0;
+            int mode = 0;
+            for (int b = 0; b < PHI_HUE_BINS; b++) {
+                s.valid += hist[b];
+                if (hist[b] > hist[mode]) mode = b;
+            }
+            s.fill_factor = s.area > 0 ? (float) s.valid / s.area : 0.f;
+            s.mode = s.mean = s.variance = s.skewness = s.kurtosis = s.k2 = s.pvalue = NAN;
+            if (s.fill_factor <= min_fill_factor || s.valid == 0) continue;
+
+            // Moments of the rounded hue, like the script does on its samples.
+            double mean = 0, m2 = 0, m3 = 0, m4 = 0;
+            for (int b = 0; b < PHI_HUE_BINS; b++) mean += hist[b] * (double) b;
+            mean /= s.valid;
+            for (int b = 0; b < PHI_HUE_BINS; b++) {
+                double d = b - mean, d2 = d * d;
+                m2 += hist[b] * d2;
+                m3 += hist[b] * d2 * d;
+                m4 += hist[b] * d2 * d2;
+            }
+            m2 /= s.valid; m3 /= s.valid; m4 /= s.valid;
+            double scale = 1.0 / (PHI_HUE_BINS - 1);
+            s.mode = mode * scale;
+            s.mean = mean * scale;
+            s.variance = m2 * scale * scale;
+            if (m2 > 0) {
+                s.skewness = m3 / pow(m2, 1.5);
+                s.kurtosis = m4 / (m2 * m2);
+            }
+            phi_normaltest(s);
+        }
+    });
+    free(histograms);
+    free(areas);
+    return stats;
+}
+
+Image
+ImageFromSegmentPhiStats(segment_phi_stats *stats, std::size_t num_segments, std::size_t *labels, std::size_t nx, std::size_t ny, int width, int height) {
+    // Smoothed phimap: every segment painted with its modal hue, blank when undefined.
+    Image smoothed = GenImageColor(width, height, WHITE);
+    Color *pixels = (Color*) smoothed.data;
+    ParallelFor(0, height, 16, [&](std::size_t lo, std::size_t hi) {
+        std::size_t last = 0, first = segment_index(stats, num_segments, 0);
+        float mode = first < num_segments ? stats[first].mode : NAN;
+        for (int py = lo; py < hi; py++) {
+            std::size_t y = (std::size_t) py * ny / height;
+            for (int px = 0; px < width; px++) {
+                std::size_t id = labels[y * nx + (std::size_t) px * nx / width];
+                if (id != last) {
+                    std::size_t i = segment_index(stats, num_segments, last = id);
+                    mode = i < num_segments ? stats[i].mode : NAN;
+                }
+                if (!std::isnan(mode)) pixels[py * width + px] = ColorFromHSV(360.f * mode, 1.f, 1.f);
+            }
+        }
+    });
+    return smoothed;
+}
+
+bool
+phimap_statistics_write_csv(const char *filename, segment_phi_stats *stats, std::size_t num_segments) {
+    FILE *f = fopen(filename, "w");
+    if (!f) return false;
+    fprintf(f, "segment,area,valid,fill_factor,mode,mean,variance,skewness,kurtosis,k2,pvalue\n");
+    for (std::size_t i = 0; i < num_segments; i++) {
+        segment_phi_stats& s = stats[i];
+        if (s.area == 0) continue;
+        fprintf(f, "%lu,%lu,%lu,%g,%g,%g,%g,%g,%g,%g,%g\n", s.id, s.area, s.valid, s.fill_factor,
+            s.mode, s.mean, s.variance, s.skewness, s.kurtosis, s.k2, s.pvalue);
+    }
+    fclose(f);
+    return true;
+}
@@ -0,0 +1,194 @@
+// Work-stealing thread pool shared by all compute stages.
+//
+// Every worker owns a queue and takes its newest task first, while idle
+// workers steal the oldest task of another queue, which is usually the
+// largest piece left. Threads outside the pool (the main thread, for one)
+// queue their tasks in a shared queue. Tasks belong to a lane: interactive
+// work (edits, undo, display) is always taken before background work (the
+// jobs), so a long job does not delay the frame.
+//
+// ParallelFor splits a range in chunks and the calling thread works on them
+// as well, so nested loops and loops started from several jobs at once share
+// the same workers instead of starting threads of their own. Waiting threads
+// only pick up chunks of their own lane or a more urgent one, never a whole job.
+enum PoolLane { POOL_INTERACTIVE, POOL_BACKGROUND, POOL_LANES };
+
+struct PoolGroup {
+    std::atomic<int> remaining{0};
+};
+
+struct PoolTask {
+    std::function<void()> fn;
+    PoolGroup *group = nullptr;
+    PoolLane lane = POOL_INTERACTIVE;
+};
+
+struct PoolQueue {
+    std::mutex lock;
+    std::deque<PoolTask> lanes[POOL_LANES];
+};
+
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::vector<PoolQueue*> queues;       // One per worker, then the shared one
+    std::deque<std::function<void()>> jobs;
+    std::mutex lock;                      // Guards jobs and sleeping
+    std::condition_variable wake;
+    std::atomic<int> pending{0};          // Queued chunks and jobs
+    bool stop = false;
+    ~ThreadPool();
+};
+
+static thread_local int pool_index = -1;                 // Queue of this thread, -1 outside the pool
+static thread_local PoolLane pool_lane = POOL_INTERACTIVE; // Lane of the task being run
+
+static void pool_worker(ThreadPool *pool, int index);
+
+ThreadPool&
+Pool() {
+    // Started on first use, one worker per core but the one of the main thread.
+    static ThreadPool pool;
+    static std::once_flag started;
+    std::call_once(started, []() {
+        int n = std::thread::hardware_concurrency();
+        n = n > 1 ? n - 1 : 1;
+        for (int i = 0; i <= n; i++) pool.queues.push_back(new PoolQueue());
+        for (int i = 0; i < n; i++) pool.workers.emplace_back(pool_worker, &pool, i);
+    });
+    return pool;
+}
+
+int
+PoolThreads() {
+    // Threads working on a ParallelFor, the caller included.
+    return Pool().workers.size() + 1;
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto & w : workers) w.join();
+    for (auto q : queues) delete q;
+}
+
+static bool
+pool_take(ThreadPool& pool, PoolTask& task, int last_lane=POOL_LANES - 1) {
+    // Own queue newest first, then steal the oldest elsewhere; interactive lane before background, up to last_lane.
+    int n = pool.queues.size();
+    int own = pool_index >= 0 ? pool_index : n - 1;
+    for (int lane = 0; lane <= last_lane; lane++) {
+        for (int k = 0; k < n; k++) {
+            PoolQueue *q = pool.queues[(own + k) % n];
+            std::lock_guard<std::mutex> guard(q->lock);
+            std::deque<PoolTask>& tasks = q->lanes[lane];
+            if (tasks.empty()) continue;
+            if (k == 0) {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            } else {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            pool.pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+pool_run(PoolTask& task) {
+    TRACE_SCOPE(task.lane == POOL_INTERACTIVE ? "task" : "background task", "pool");
+    PoolLane saved = pool_lane;
+    pool_lane = task.lane;
+    task.fn();
+    pool_lane = saved;
+    task.group->remaining--;
+}
+
+static void
+pool_worker(ThreadPool *pool, int index) {
+    pool_index = index;
+    char name[32];
+    snprintf(name, sizeof(name), "worker %d", index);
+    TraceSetThreadName(name);
+    for (;;) {
+        PoolTask task;
+        if (pool_take(*pool, task)) {
+            pool_run(task);
+            continue;
+        }
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> guard(pool->lock);
+            if (pool->stop) return;
+            if (!pool->jobs.empty()) {
+                job = std::move(pool->jobs.front());
+                pool->jobs.pop_front();
+                pool->pending--;
+            } else if (pool->pending.load() == 0) {
+                pool->wake.wait_for(guard, std::chrono::milliseconds(10));
+                continue;
+            }
+        }
+        if (job) {
+            pool_lane = POOL_BACKGROUND;
+            job();
+            pool_lane = POOL_INTERACTIVE;
+        }
+    }
+}
+
+void
+PoolSubmitJob(std::function<void()> job) {
+    // A long task (a whole job), its loops run in the background lane.
+    ThreadPool& pool = Pool();
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.jobs.push_back(job);
+        pool.pending++;
+    }
+    pool.wake.notify_one();
+}
+
+template<typename Body>
+void
+ParallelFor(std::size_t begin, std::size_t end, std::size_t grain, Body body) {
+/*
+    Calls body(lo, hi) on consecutive sub-ranges of [begin, end), at least
+    grain long, and returns once all of them are done. The sub-ranges run
+    in the lane of the calling task.
+*/
+    if (end <= begin) return;
+    ThreadPool& pool = Pool();
+    std::size_t n = end - begin;
+    std::size_t chunk = (n + 4 * PoolThreads() - 1) / (4 * PoolThreads());
+    chunk = chunk > grain ? chunk : (grain > 0 ? grain : 1);
+    if (chunk >= n) {
+        body(begin, end);
+        return;
+    }
+    PoolGroup group;
+    PoolQueue *q = pool.queues[pool_index >= 0 ? pool_index : pool.queues.size() - 1];
+    {
+        std::lock_guard<std::mutex> guard(q->lock);
+        // Pushed last to first, so the owner takes them in order.
+        for (std::size_t c = (n - 1) / chunk; c > 0; c--) {
+            std::size_t lo = begin + c * chunk, hi = lo + chunk < end ? lo + chunk : end;
+            q->lanes[pool_lane].push_back((PoolTask) {[&body, lo, hi]() { body(lo, hi); }, &group, pool_lane});
+            group.remaining++;
+            pool.pending++;
+        }
+    }
+    pool.wake.notify_all();
+    body(begin, begin + chunk);
+    while (group.remaining.load() > 0) {
+        // Never a task of a lower lane: an interactive loop must not wait on a background chunk.
+        PoolTask task;
+        if (pool_take(pool, task, pool_lane)) pool_run(task);
+        else std::this_thread::yield();
+    }
+}
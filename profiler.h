@@ -0,0 +1,116 @@
+// Scoped timers for the pipeline stages, and an overlay to show them.
+// Every timed scope is also recorded in the trace (see trace.h).
+//
+// A stage is registered once per call site and accumulates the time of its
+// scopes, from any thread. At the end of every frame the main thread moves
+// each total into a ring of the last PROFILE_HISTORY frames, which the
+// overlay draws as one small histogram per stage. A stage run by a job lands
+// in the frame where it ended, as a single spike.
+#define PROFILE_HISTORY 120
+#define PROFILE_MAX_STAGES 64
+
+struct ProfileStage {
+    const char *name;
+    std::atomic<uint64_t> pending_ns{0};   // Time of the scopes ended during this frame
+    std::atomic<uint32_t> pending_calls{0};
+    float history[PROFILE_HISTORY];        // Milliseconds per frame
+    std::atomic<float> last_ms{0};         // Duration of the last scope
+    uint32_t calls = 0;
+};
+
+struct Profiler {
+    ProfileStage stages[PROFILE_MAX_STAGES];
+    std::atomic<int> num_stages{0};
+    std::mutex lock;                       // Registration only
+    int frame = 0;
+    bool visible = false;
+};
+
+Profiler&
+GetProfiler() {
+    static Profiler profiler;
+    return profiler;
+}
+
+ProfileStage *
+profile_stage(const char *name) {
+    Profiler& p = GetProfiler();
+    std::lock_guard<std::mutex> guard(p.lock);
+    int n = p.num_stages.load();
+    for (int i = 0; i < n; i++) if (strcmp(p.stages[i].name, name) == 0) return &p.stages[i];
+    assert(n < PROFILE_MAX_STAGES);
+    ProfileStage *s = &p.stages[n];
+    s->name = name;
+    memset(s->history, 0, sizeof(s->history));
+    p.num_stages.store(n + 1);
+    return s;
+}
+
+struct ProfileTimer {
+    ProfileStage *stage;
+    std::chrono::steady_clock::time_point start;
+    ProfileTimer(ProfileStage *s) : stage(s), start(std::chrono::steady_clock::now()) {}
+    ~ProfileTimer() { Stop(); }
+    void Stop() {
+        // Ends the scope early, later calls do nothing.
+        if (!stage) return;
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        stage->pending_ns += ns;
+        stage->pending_calls++;
+        stage->last_ms = ns * 1e-6f;
+        TraceRecord(stage->name, "stage", std::chrono::duration_cast<std::chrono::nanoseconds>(start - GetTracer().epoch).count(), ns);
+        stage = nullptr;
+    }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// The stage of this call site, looked up once.
+#define PROFILE_STAGE(name) ([]() { static ProfileStage *s = profile_stage(name); return s; }())
+// Times the rest of the enclosing block.
+#define PROFILE_SCOPE(name) ProfileTimer PROFILE_CONCAT(profile_timer_, __LINE__)(PROFILE_STAGE(name))
+
+void
+ProfileFrameEnd() {
+    // Main thread, once per frame.
+    Profiler& p = GetProfiler();
+    int slot = p.frame++ % PROFILE_HISTORY;
+    int n = p.num_stages.load();
+    for (int i = 0; i < n; i++) {
+        ProfileStage& s = p.stages[i];
+        s.history[slot] = s.pending_ns.exchange(0) * 1e-6f;
+        s.calls += s.pending_calls.exchange(0);
+    }
+}
+
+Rectangle
+DrawProfileOverlay(float x, float y) {
+/*
+    One row per stage seen so far: its name, the last duration, the worst
+    frame of the window and the per-frame histogram, oldest on the left.
+    Returns the area used.
+*/
+    Profiler& p = GetProfiler();
+    int n = p.num_stages.load();
+    float row = 16, name_w = 150, text_w = 130, plot_w = PROFILE_HISTORY;
+    Rectangle area = {x, y, name_w + text_w + plot_w + 10, n * row + 6};
+    DrawRectangleRec(area, Fade(BLACK, 0.7f));
+    for (int i = 0; i < n; i++) {
+        ProfileStage& s = p.stages[i];
+        float ry = y + 3 + i * row;
+        float peak = 0;
+        for (int k = 0; k < PROFILE_HISTORY; k++) peak = fmax(peak, s.history[k]);
+        DrawText(s.name, x + 5, ry + 2, 10, RAYWHITE);
+        DrawText(TextFormat("%8.2f ms  max %8.2f", s.last_ms.load(), peak), x + 5 + name_w, ry + 2, 10, RAYWHITE);
+        float px = x + 5 + name_w + text_w;
+        // Bars are scaled to at least one frame at 60 fps, so idle stages stay flat.
+        float scale = (row - 2) / fmax(peak, 16.7f);
+        for (int k = 0; k < PROFILE_HISTORY; k++) {
+            float v = s.history[(p.frame + k) % PROFILE_HISTORY];
+            if (v <= 0) continue;
+            float h = fmin(v * scale, row - 2);
+            DrawRectangle(px + k, ry + row - 1 - h, 1, h, v > 16.7f ? RED : GREEN);
+        }
+    }
+    return area;
+}
@@ -0,0 +1,412 @@
+// Chunked project container (.bin), one chunk per layer.
+//
+//   header   "STCHPRJ\0", format version, number of chunks, offset of the table
+//   chunks   back to back, each encoded on its own
+//   table    one ChunkInfo per chunk: type, version, encoding, place, size,
+//            image geometry and CRC-32 of the stored bytes
+//
+// The table is written last, so chunks are streamed to disk as they are
+// encoded, and any chunk can be read without the others, or copied as it is
+// from one file into the next when its layer did not change. Label maps are
+// stored delta+RLE: runs of equal labels as (run length, zigzag difference
+// with the previous run), both as varints, which shrinks them by orders of
+// magnitude. Images are stored raw. Integers are little-endian.
+//
+// Files from before this format (a bare size_t header and every layer
+// concatenated) are recognized by the missing magic and read by the caller.
+// A file with the magic is never read as one of those, even when damaged or
+// from a newer version.
+#define PROJECT_FILE_MAGIC "STCHPRJ"
+#define PROJECT_FILE_VERSION 1
+#define PROJECT_FILE_BLOCK (1 << 20)
+#define PROJECT_FILE_STRIP (1 << 18)    // Labels encoded per task, and per piece of EncodedLabels
+
+enum ChunkEncoding { CHUNK_RAW = 0, CHUNK_DELTA_RLE64 = 1 };
+
+struct ChunkInfo {
+    char type[8];                   // Zero padded, e.g. "STEP0", "LABELS2"
+    uint32_t version;               // Of the chunk type
+    uint32_t encoding;              // ChunkEncoding
+    uint64_t offset;                // In the file
+    uint64_t stored_size;
+    uint64_t raw_size;              // Once decoded
+    uint32_t width, height, format; // Image geometry, raylib pixel format or 0 for labels
+    uint32_t crc;                   // CRC-32 of the stored bytes
+};
+
+struct ProjectFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_chunks;
+    uint64_t table_offset;
+};
+
+struct ProjectFile {
+    FILE *f = nullptr;
+    std::vector<ChunkInfo> table;
+};
+
+uint32_t
+Crc32(uint32_t crc, const uint8_t *data, std::size_t n) {
+    // Running CRC-32 (IEEE), start with 0.
+    static uint32_t table[256];
+    static std::once_flag made;
+    std::call_once(made, []() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    });
+    crc = ~crc;
+    for (std::size_t i = 0; i < n; i++) crc = table[(crc ^ data[i]) & 255] ^ (crc >> 8);
+    return ~crc;
+}
+
+static inline void
+chunk_put_varint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 128) {
+        out.push_back((v & 127) | 128);
+        v >>= 7;
+    }
+    out.push_back(v);
+}
+
+static void
+chunk_encode_labels(std::vector<uint8_t>& out, const uint64_t *labels, uint64_t lo, uint64_t hi) {
+    // Runs of labels[lo, hi), the first one relative to labels[lo - 1].
+    uint64_t previous = lo > 0 ? labels[lo - 1] : 0;
+    for (uint64_t i = lo; i < hi;) {
+        uint64_t run = 1;
+        while (i + run < hi && labels[i + run] == labels[i]) run++;
+        int64_t delta = (int64_t) (labels[i] - previous);
+        chunk_put_varint(out, run);
+        chunk_put_varint(out, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+        previous = labels[i];
+        i += run;
+    }
+}
+
+// A label map encoded as CHUNK_DELTA_RLE64, one piece per strip of
+// PROJECT_FILE_STRIP labels. A run crossing two strips is stored as two runs,
+// which decodes the same. Pieces are immutable and shared: a snapshot copies
+// the pointers, and after an edit only the strips it touched are encoded
+// again, so snapshotting a large, mostly unchanged map takes microseconds.
+struct EncodedLabels {
+    uint64_t n = 0;
+    std::vector<std::shared_ptr<const std::vector<uint8_t>>> strips;   // nullptr once stale
+};
+
+void
+EncodedLabelsInvalidate(EncodedLabels& e, uint64_t lo, uint64_t hi) {
+    // Labels [lo, hi) changed. The strip starting at hi is stale too, its first run is relative to hi - 1.
+    if (e.strips.empty() || lo >= hi) return;
+    uint64_t last = hi / PROJECT_FILE_STRIP < e.strips.size() ? hi / PROJECT_FILE_STRIP : e.strips.size() - 1;
+    for (uint64_t s = lo / PROJECT_FILE_STRIP; s <= last; s++) e.strips[s] = nullptr;
+}
+
+void
+ProjectFileEncodeLabels(EncodedLabels& e, const uint64_t *labels, uint64_t n) {
+    // Encodes the stale strips of n labels, in parallel. Cheap enough for the main thread.
+    if (e.n != n) {
+        e.n = n;
+        e.strips.assign((n + PROJECT_FILE_STRIP - 1) / PROJECT_FILE_STRIP, nullptr);
+    }
+    std::vector<uint64_t> stale;
+    for (uint64_t s = 0; s < e.strips.size(); s++) if (!e.strips[s]) stale.push_back(s);
+    ParallelFor(0, stale.size(), 1, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t k = lo; k < hi; k++) {
+            uint64_t s = stale[k], end = (s + 1) * PROJECT_FILE_STRIP < n ? (s + 1) * PROJECT_FILE_STRIP : n;
+            auto piece = std::make_shared<std::vector<uint8_t>>();
+            chunk_encode_labels(*piece, labels, s * PROJECT_FILE_STRIP, end);
+            e.strips[s] = piece;
+        }
+    });
+}
+
+static ChunkInfo
+chunk_info(ProjectFile& pf, const char *type, uint32_t version, ChunkEncoding encoding, uint64_t raw_size,
+           uint32_t width, uint32_t height, uint32_t format) {
+    // A table entry for a chunk starting at the current end of the file.
+    ChunkInfo info = {};
+    snprintf(info.type, sizeof(info.type), "%s", type);
+    info.version = version;
+    info.encoding = encoding;
+    info.offset = ftell(pf.f);
+    info.raw_size = raw_size;
+    info.width = width;
+    info.height = height;
+    info.format = format;
+    return info;
+}
+
+static bool
+chunk_flush(FILE *f, std::vector<uint8_t>& out, ChunkInfo& info) {
+    if (out.empty()) return true;
+    info.crc = Crc32(info.crc, out.data(), out.size());
+    info.stored_size += out.size();
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    out.clear();
+    return ok;
+}
+
+bool
+ProjectFileCreate(const char *path, ProjectFile& pf) {
+    // Starts a file, chunks follow with ProjectFileWriteChunk.
+    pf.f = fopen(path, "wb");
+    pf.table.clear();
+    if (!pf.f) return false;
+    ProjectFileHeader header = {PROJECT_FILE_MAGIC, PROJECT_FILE_VERSION, 0, 0};
+    return fwrite(&header, sizeof(header), 1, pf.f) == 1;
+}
+
+bool
+ProjectFileWriteChunk(ProjectFile& pf, const char *type, uint32_t version, ChunkEncoding encoding,
+                      const void *data, uint64_t raw_size, uint32_t width=0, uint32_t height=0, uint32_t format=0) {
+/*
+    Appends one chunk, encoded and written block by block: the file never
+    needs a second copy of the layer in memory. CHUNK_DELTA_RLE64 takes an
+    array of 64-bit labels.
+*/
+    ChunkInfo info = chunk_info(pf, type, version, encoding, raw_size, width, height, format);
+    std::vector<uint8_t> out;
+    out.reserve(PROJECT_FILE_BLOCK + 32);
+    bool ok = true;
+    const uint8_t *bytes = (const uint8_t*) data;
+    if (encoding == CHUNK_RAW) {
+        for (uint64_t done = 0; done < raw_size && ok; done += PROJECT_FILE_BLOCK) {
+            uint64_t n = raw_size - done < PROJECT_FILE_BLOCK ? raw_size - done : PROJECT_FILE_BLOCK;
+            out.assign(bytes + done, bytes + done + n);
+            ok = chunk_flush(pf.f, out, info);
+        }
+    } else {
+        assert(raw_size % sizeof(uint64_t) == 0);
+        const uint64_t *labels = (const uint64_t*) data;
+        uint64_t n = raw_size / sizeof(uint64_t);
+        for (uint64_t lo = 0; lo < n && ok; lo += PROJECT_FILE_STRIP) {
+            chunk_encode_labels(out, labels, lo, lo + PROJECT_FILE_STRIP < n ? lo + PROJECT_FILE_STRIP : n);
+            if (out.size() >= PROJECT_FILE_BLOCK) ok = chunk_flush(pf.f, out, info);
+        }
+        ok = ok && chunk_flush(pf.f, out, info);
+    }
+    if (ok) pf.table.push_back(info);
+    return ok;
+}
+
+bool
+ProjectFileWriteEncoded(ProjectFile& pf, const char *type, uint32_t version, const EncodedLabels& e, uint32_t width=0, uint32_t height=0) {
+    // Appends the label chunk encoded by ProjectFileEncodeLabels, every strip must be up to date.
+    ChunkInfo info = chunk_info(pf, type, version, CHUNK_DELTA_RLE64, e.n * sizeof(uint64_t), width, height, 0);
+    bool ok = true;
+    for (auto & piece : e.strips) {
+        if (!ok) break;
+        assert(piece);
+        info.crc = Crc32(info.crc, piece->data(), piece->size());
+        info.stored_size += piece->size();
+        ok = piece->empty() || fwrite(piece->data(), 1, piece->size(), pf.f) == piece->size();
+    }
+    if (ok) pf.table.push_back(info);
+    return ok;
+}
+
+bool
+ProjectFileFinish(ProjectFile& pf) {
+    // Writes the table and the header, and closes the file.
+    ProjectFileHeader header = {PROJECT_FILE_MAGIC, PROJECT_FILE_VERSION, (uint32_t) pf.table.size(), (uint64_t) ftell(pf.f)};
+    bool ok = pf.table.empty() || fwrite(pf.table.data(), sizeof(ChunkInfo), pf.table.size(), pf.f) == pf.table.size();
+    ok = ok && fseek(pf.f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, pf.f) == 1;
+    ok = fclose(pf.f) == 0 && ok;
+    pf.f = nullptr;
+    return ok;
+}
+
+bool
+ProjectFileOpen(const char *path, ProjectFile& pf, bool *chunked=nullptr) {
+/*
+    Reads the table; false for a missing file, a legacy file, a newer
+    version or a damaged table. chunked, if given, tells whether the file
+    starts with the magic, i.e. is not a legacy file.
+*/
+    pf.f = fopen(path, "rb");
+    pf.table.clear();
+    if (chunked) *chunked = false;
+    if (!pf.f) return false;
+    ProjectFileHeader header;
+    struct stat st;
+    bool ok = fread(&header, sizeof(header), 1, pf.f) == 1 && memcmp(header.magic, PROJECT_FILE_MAGIC, 8) == 0;
+    if (chunked) *chunked = ok;
+    ok = ok && header.version <= PROJECT_FILE_VERSION && fstat(fileno(pf.f), &st) == 0;
+    // A table that cannot fit in the file is damaged, not a reason to allocate num_chunks entries.
+    ok = ok && header.table_offset <= (uint64_t) st.st_size
+        && header.num_chunks <= ((uint64_t) st.st_size - header.table_offset) / sizeof(ChunkInfo)
+        && fseek(pf.f, header.table_offset, SEEK_SET) == 0;
+    if (ok) {
+        pf.table.resize(header.num_chunks);
+        ok = header.num_chunks == 0 || fread(pf.table.data(), sizeof(ChunkInfo), header.num_chunks, pf.f) == header.num_chunks;
+    }
+    if (!ok) {
+        fclose(pf.f);
+        pf.f = nullptr;
+        pf.table.clear();
+    }
+    return ok;
+}
+
+void
+ProjectFileClose(ProjectFile& pf) {
+    if (pf.f) fclose(pf.f);
+    pf.f = nullptr;
+    pf.table.clear();
+}
+
+const ChunkInfo *
+ProjectFileFind(const ProjectFile& pf, const char *type) {
+    // The last chunk of that type, nullptr if none.
+    for (auto it = pf.table.rbegin(); it != pf.table.rend(); it++) {
+        if (strncmp(it->type, type, sizeof(it->type)) == 0) return &*it;
+    }
+    return nullptr;
+}
+
+struct chunk_reader {
+    FILE *f;
+    uint64_t left;                  // Stored bytes not read yet
+    uint32_t crc = 0;
+    std::vector<uint8_t> block;
+    std::size_t pos = 0;
+    bool failed = false;
+};
+
+static bool
+chunk_refill(chunk_reader& r) {
+    std::size_t n = r.left < PROJECT_FILE_BLOCK ? r.left : PROJECT_FILE_BLOCK;
+    r.block.resize(n);
+    r.pos = 0;
+    if (n == 0 || fread(r.block.data(), 1, n, r.f) != n) return !(r.failed = true);
+    r.left -= n;
+    r.crc = Crc32(r.crc, r.block.data(), n);
+    return true;
+}
+
+static inline uint64_t
+chunk_get_varint(chunk_reader& r) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r.pos == r.block.size() && !chunk_refill(r)) return 0;
+        uint8_t b = r.block[r.pos++];
+        v |= (uint64_t) (b & 127) << shift;
+        if (!(b & 128)) return v;
+    }
+    r.failed = true;
+    return 0;
+}
+
+bool
+ProjectFileReadChunk(ProjectFile& pf, const ChunkInfo& info, void *dest) {
+/*
+    Decodes the chunk into dest (raw_size bytes), block by block. False on a
+    read error, a CRC mismatch or a stream not matching raw_size; dest may
+    then hold part of the chunk.
+*/
+    if (fseek(pf.f, info.offset, SEEK_SET) != 0) return false;
+    chunk_reader r = {pf.f, info.stored_size};
+    uint8_t *bytes = (uint8_t*) dest;
+    if (info.encoding == CHUNK_RAW) {
+        if (info.stored_size != info.raw_size) return false;
+        for (uint64_t done = 0; done < info.raw_size; done += r.block.size()) {
+            if (!chunk_refill(r)) return false;
+            memcpy(bytes + done, r.block.data(), r.block.size());
+        }
+    } else if (info.encoding == CHUNK_DELTA_RLE64) {
+        uint64_t *labels = (uint64_t*) dest;
+        uint64_t n = info.raw_size / sizeof(uint64_t), i = 0, value = 0;
+        while (i < n && !r.failed) {
+            uint64_t run = chunk_get_varint(r);
+            uint64_t zigzag = chunk_get_varint(r);
+            value += (uint64_t) ((int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1));
+            if (r.failed || run == 0 || run > n - i) return false;
+            std::fill(labels + i, labels + i + run, value);
+            i += run;
+        }
+        if (r.failed || r.pos != r.block.size() || r.left != 0) return false;
+    } else {
+        return false;
+    }
+    return r.crc == info.crc;
+}
+
+bool
+ProjectFileCopyChunk(ProjectFile& pf, ProjectFile& from, const ChunkInfo& info) {
+/*
+    Appends chunk info of from as it is stored, with its CRC, so a damaged
+    chunk stays detectable. Nothing is decoded; on Linux the kernel copies
+    the bytes (sharing them outright on file systems with reflinks).
+*/
+    ChunkInfo copy = info;
+    copy.offset = ftell(pf.f);
+    uint64_t done = 0;
+#ifdef __linux__
+    if (fflush(pf.f) == 0) {
+        off_t in = info.offset, out = copy.offset;
+        while (done < info.stored_size) {
+            ssize_t n = copy_file_range(fileno(from.f), &in, fileno(pf.f), &out, info.stored_size - done, 0);
+            if (n <= 0) break;
+            done += n;
+        }
+        if (fseek(pf.f, copy.offset + done, SEEK_SET) != 0) return false;
+    }
+#endif
+    // Elsewhere, or where the kernel cannot copy between these files, through a buffer.
+    std::vector<uint8_t> block;
+    if (done < info.stored_size && fseek(from.f, info.offset + done, SEEK_SET) != 0) return false;
+    while (done < info.stored_size) {
+        std::size_t n = info.stored_size - done < PROJECT_FILE_BLOCK ? info.stored_size - done : PROJECT_FILE_BLOCK;
+        block.resize(n);
+        if (fread(block.data(), 1, n, from.f) != n || fwrite(block.data(), 1, n, pf.f) != n) return false;
+        done += n;
+    }
+    pf.table.push_back(copy);
+    return true;
+}
+
+// A mapped project file. Raw chunks are used in place as the pixels of the
+// step images: nothing is read until a page is touched, and the mapping is
+// private, so edits to those pixels stay in memory and never reach the file.
+struct ProjectMapping {
+    uint8_t *base = nullptr;
+    std::size_t size = 0;
+};
+
+bool
+ProjectFileMap(const char *path, ProjectMapping& m) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size > 0;
+    void *p = ok ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd); // The mapping keeps the file
+    if (p == MAP_FAILED) return false;
+    m.base = (uint8_t*) p;
+    m.size = st.st_size;
+    return true;
+}
+
+void
+ProjectFileUnmap(ProjectMapping& m) {
+    if (m.base) munmap(m.base, m.size);
+    m = ProjectMapping();
+}
+
+bool
+ProjectMappingOwns(const ProjectMapping& m, const void *p) {
+    return m.base && (const uint8_t*) p >= m.base && (const uint8_t*) p < m.base + m.size;
+}
+
+void *
+ProjectFileView(const ProjectMapping& m, const ChunkInfo& info) {
+    // The decoded bytes of a raw chunk inside the mapping, nullptr for other encodings.
+    // Unlike ProjectFileReadChunk the CRC is not checked, that would read every page.
+    if (!m.base || info.encoding != CHUNK_RAW || info.stored_size != info.raw_size) return nullptr;
+    if (info.offset > m.size || info.raw_size > m.size - info.offset) return nullptr;
+    return m.base + info.offset;
+}
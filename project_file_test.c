@@ -0,0 +1,203 @@
+#include <stdint.h>
+#include <cstring>
+#include <cassert>
+#include <cstdio>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <random>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "trace.h"
+#include "pool.h"
+#include "project_file.h"
+
+static bool
+read_back(const char *path, const char *type, void *dest, ChunkInfo *info=nullptr) {
+    // Opens path and decodes its chunk of that type into dest.
+    ProjectFile pf;
+    if (!ProjectFileOpen(path, pf)) return false;
+    const ChunkInfo *c = ProjectFileFind(pf, type);
+    bool ok = c && ProjectFileReadChunk(pf, *c, dest);
+    if (c && info) *info = *c;
+    ProjectFileClose(pf);
+    return ok;
+}
+
+static void
+patch_file(const char *path, long offset, const void *bytes, std::size_t n) {
+    FILE *f = fopen(path, "r+b");
+    assert(f && fseek(f, offset, SEEK_SET) == 0 && fwrite(bytes, 1, n, f) == n);
+    fclose(f);
+}
+
+static std::vector<uint64_t>
+encoded_round_trip(const EncodedLabels& e, const char *path) {
+    // Writes e with ProjectFileWriteEncoded and decodes it again.
+    ProjectFile pf;
+    assert(ProjectFileCreate(path, pf));
+    assert(ProjectFileWriteEncoded(pf, "LABELS0", 1, e));
+    assert(ProjectFileFinish(pf));
+    std::vector<uint64_t> labels(e.n);
+    assert(read_back(path, "LABELS0", labels.data()));
+    return labels;
+}
+
+static void
+edit_rect(EncodedLabels& e, std::vector<uint64_t>& labels, int w, int x0, int y0, int x1, int y1, uint64_t value) {
+    // Sets the rectangle to decreasing labels from value and invalidates it as MarkLabelsChanged does.
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) labels[(std::size_t) y * w + x] = value - (x - x0) / 3;
+    }
+    EncodedLabelsInvalidate(e, (uint64_t) y0 * w + x0, (uint64_t) (y1 - 1) * w + x1);
+}
+
+static void
+test_encoded_labels(const char *path) {
+    // Strips encoded once and shared by snapshots must decode as the labels of their snapshot.
+    int w = 1024, h = 1100;
+    assert((std::size_t) w * 256 == PROJECT_FILE_STRIP);
+    std::size_t n = (std::size_t) w * h;
+    std::vector<uint64_t> labels(n);
+    std::mt19937 rng(2);
+    uint64_t value = 5;
+    for (std::size_t i = 0; i < n; i++) {
+        if (rng() % 50 == 0) value = rng() % 100000;
+        labels[i] = value;
+    }
+    EncodedLabels e;
+    ProjectFileEncodeLabels(e, labels.data(), n);
+    assert(encoded_round_trip(e, path) == labels);
+
+    // Ends exactly where strip 2 starts: its first run is relative to the last edited label.
+    EncodedLabels before = e;
+    std::vector<uint64_t> labels_before = labels;
+    edit_rect(e, labels, w, 1000, 300, w, 512, 999999);
+    int stale = 0;
+    for (auto & piece : e.strips) stale += !piece;
+    assert(stale == 2 && !e.strips[1] && !e.strips[2]);
+    ProjectFileEncodeLabels(e, labels.data(), n);
+    assert(encoded_round_trip(e, path) == labels);
+    assert(encoded_round_trip(before, path) == labels_before);
+
+    // Ends in the middle of strip 2.
+    EncodedLabels middle = e;
+    std::vector<uint64_t> labels_middle = labels;
+    edit_rect(e, labels, w, 10, 600, 20, 605, 12);
+    ProjectFileEncodeLabels(e, labels.data(), n);
+    assert(encoded_round_trip(e, path) == labels);
+    assert(encoded_round_trip(middle, path) == labels_middle);
+    assert(encoded_round_trip(before, path) == labels_before);
+
+    // The last label.
+    labels[n - 1]++;
+    EncodedLabelsInvalidate(e, n - 1, n);
+    ProjectFileEncodeLabels(e, labels.data(), n);
+    assert(encoded_round_trip(e, path) == labels);
+}
+
+int main(int argc, char** argv) {
+    const char *path = "project_file_test.bin", *copy_path = "project_file_test_copy.bin";
+    std::mt19937 rng(1);
+
+    // Raw bytes, across several blocks.
+    std::vector<uint8_t> image(PROJECT_FILE_BLOCK * 2 + 12345);
+    for (auto & b : image) b = rng();
+    // Labels with runs crossing strips, negative deltas, extreme values and a partial last strip.
+    std::size_t n = PROJECT_FILE_STRIP * 3 + 777;
+    std::vector<uint64_t> labels(n);
+    uint64_t value = 1000;
+    for (std::size_t i = 0; i < n; i++) {
+        if (rng() % 40 == 0) value = rng() % 2 ? value - rng() % 500 : value + rng() % 500;
+        labels[i] = value;
+    }
+    for (std::size_t i = PROJECT_FILE_STRIP - 100; i < PROJECT_FILE_STRIP + 100; i++) labels[i] = 42;
+    for (std::size_t i = 2 * PROJECT_FILE_STRIP - 1; i < 2 * PROJECT_FILE_STRIP + 1; i++) labels[i] = 7;
+    labels[0] = ~0ull;
+    labels[1] = 0;
+    labels[2] = 1ull << 63;
+    labels[3] = 5;
+
+    ProjectFile pf;
+    assert(ProjectFileCreate(path, pf));
+    assert(ProjectFileWriteChunk(pf, "STEP0", 1, CHUNK_RAW, image.data(), image.size(), 1, image.size() / 4, 7));
+    assert(ProjectFileWriteChunk(pf, "LABELS0", 1, CHUNK_DELTA_RLE64, labels.data(), n * sizeof(uint64_t)));
+    assert(ProjectFileWriteChunk(pf, "EMPTY", 1, CHUNK_DELTA_RLE64, nullptr, 0));
+    assert(ProjectFileFinish(pf));
+
+    std::vector<uint8_t> image_read(image.size());
+    std::vector<uint64_t> labels_read(n);
+    ChunkInfo info;
+    assert(read_back(path, "STEP0", image_read.data()) && image_read == image);
+    assert(read_back(path, "LABELS0", labels_read.data(), &info) && labels_read == labels);
+    assert(info.stored_size < n);
+    assert(read_back(path, "EMPTY", nullptr));
+
+    // A short stream, and a stream shorter than the labels it should hold.
+    assert(ProjectFileOpen(path, pf));
+    ChunkInfo shorter = info;
+    shorter.stored_size--;
+    assert(!ProjectFileReadChunk(pf, shorter, labels_read.data()));
+    ChunkInfo longer = info;
+    longer.raw_size += sizeof(uint64_t);
+    labels_read.resize(n + 1);
+    assert(!ProjectFileReadChunk(pf, longer, labels_read.data()));
+    labels_read.resize(n);
+
+    // A copied chunk keeps its bytes and CRC.
+    ProjectFile copy;
+    assert(ProjectFileCreate(copy_path, copy));
+    assert(ProjectFileCopyChunk(copy, pf, *ProjectFileFind(pf, "STEP0")));
+    assert(ProjectFileCopyChunk(copy, pf, info));
+    assert(ProjectFileFinish(copy));
+    ProjectFileClose(pf);
+    ChunkInfo copied;
+    assert(read_back(copy_path, "LABELS0", labels_read.data(), &copied) && labels_read == labels);
+    assert(copied.crc == info.crc && copied.stored_size == info.stored_size);
+    assert(read_back(copy_path, "STEP0", image_read.data()) && image_read == image);
+
+    // A flipped byte fails the CRC.
+    uint8_t byte;
+    FILE *f = fopen(path, "rb");
+    assert(f && fseek(f, info.offset + info.stored_size / 2, SEEK_SET) == 0 && fread(&byte, 1, 1, f) == 1);
+    fclose(f);
+    byte ^= 0x10;
+    patch_file(path, info.offset + info.stored_size / 2, &byte, 1);
+    assert(!read_back(path, "LABELS0", labels_read.data()));
+    assert(read_back(path, "STEP0", image_read.data()) && image_read == image);
+
+    // A damaged table is refused without allocating it, and still known as a chunked file.
+    bool chunked = false;
+    uint32_t num_chunks = 0xffffffffu;
+    patch_file(path, offsetof(ProjectFileHeader, num_chunks), &num_chunks, sizeof(num_chunks));
+    assert(!ProjectFileOpen(path, pf, &chunked) && chunked && pf.f == nullptr && pf.table.empty());
+    uint64_t table_offset = 1ull << 40;
+    patch_file(path, offsetof(ProjectFileHeader, table_offset), &table_offset, sizeof(table_offset));
+    num_chunks = 3;
+    patch_file(path, offsetof(ProjectFileHeader, num_chunks), &num_chunks, sizeof(num_chunks));
+    assert(!ProjectFileOpen(path, pf, &chunked) && chunked);
+    uint32_t version = PROJECT_FILE_VERSION + 1;
+    patch_file(path, offsetof(ProjectFileHeader, version), &version, sizeof(version));
+    assert(!ProjectFileOpen(path, pf, &chunked) && chunked);
+
+    // A legacy file has no magic.
+    uint64_t legacy_len = 1 << 20;
+    patch_file(path, 0, &legacy_len, sizeof(legacy_len));
+    assert(!ProjectFileOpen(path, pf, &chunked) && !chunked);
+
+    test_encoded_labels(path);
+
+    remove(path);
+    remove(copy_path);
+    printf("project_file_test passed\n");
+    return 0;
+}
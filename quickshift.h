@@ -1,7 +1,7 @@
 #include <raylib.h>
 
 void
-quickshift(Image image, int kernel_size, int max_dist, std::size_t *parent, float ratio, int random_seed=42) {
+quickshift(Image image, int kernel_size, int max_dist, std::size_t *parent, float ratio, int random_seed=42, JobProgress *progress=nullptr) {
 /*
     Parameters
     ----------
@@ -24,11 +24,14 @@ quickshift(Image image, int kernel_size, int max_dist, std::size_t *parent, floa
         is used.
 
         Random seed used for breaking ties.
+    progress : optional, receives the fraction done and is polled for
+        cancellation, in which case parent is left incomplete.
     Returns
     -------
     segment_mask : (width, height) ndarray
         Integer mask indicating segment labels.
 */
+    PROFILE_SCOPE("quickshift");
     double start = GetTime();
     float inv_kernel_size_sqr = -0.5 / (float) (kernel_size * kernel_size);
     int kernel_width = (int) ceil(3 * kernel_size);
@@ -44,9 +47,6 @@ quickshift(Image image, int kernel_size, int max_dist, std::size_t *parent, floa
         densities[i] = 0.00001f * sqrtf(-2.f  * logf(u1)) * cosf(2.f*M_PI*u2);
     }
 
-    float current_density, closest;
-    std::size_t r_, c_;
-
     float * buffer = (float*)calloc(image.height*image.width*3, sizeof(float));
     float * dist_parent = (float*)malloc(width*height*sizeof(float));
     int counter = 0;
@@ -60,76 +60,54 @@ quickshift(Image image, int kernel_size, int max_dist, std::size_t *parent, floa
         }
     }
 
-    for (int i = 0; i < height * width; i++) {
-        float r = buffer[i * channels + 0];
-        float g = buffer[i * channels + 1];
-        float b = buffer[i * channels + 2];
-
-        // RGB 2 XYZ
-        r = r > 0.04045 ? powf((r + 0.055f) / 1.055f, 2.4f): r / 12.92f;
-        g = g > 0.04045 ? powf((g + 0.055f) / 1.055f, 2.4f): g / 12.92f;
-        b = b > 0.04045 ? powf((b + 0.055f) / 1.055f, 2.4f): b / 12.92f;
-        float x = 100.f * (r * 0.4124f + g * 0.3576f + b *  0.1805f);
-        float y = 100.f * (r * 0.2126f + g * 0.7152f + b *  0.0722f);
-        float z = 100.f * (r * 0.0193f + g * 0.1192f + b *  0.9505f);
-        // XYZ 2 L-ab
-        x /= 95.047f; 
-        y /= 100.000f; 
-        z /= 108.883f;
-        x = x > 0.008856 ? cbrtf(x): (7.787f * x ) + ( 16.f / 116.f );
-        y = y > 0.008856 ? cbrtf(y): (7.787f * y ) + ( 16.f / 116.f );
-        z = z > 0.008856 ? cbrtf(z): (7.787f * z ) + ( 16.f / 116.f );
+    ProfileTimer lab_timer(PROFILE_STAGE("quickshift lab"));
+    ParallelFor(0, height * width, 4096, [&](std::size_t lo, std::size_t hi) {
+        for (int i = lo; i < hi; i++) {
+            float r = buffer[i * channels + 0];
+            float g = buffer[i * channels + 1];
+            float b = buffer[i * channels + 2];
 
-        float L = (116.f * y ) - 16.f;
-        float a = 500.f * ( x - y );
-        float bb = 200 * ( y - z );
-        buffer[i * channels  + 0] = ratio * L;
-        buffer[i * channels  + 1] = ratio * a;
-        buffer[i * channels  + 2] = ratio * bb;
-    }
+            // RGB 2 XYZ
+            r = r > 0.04045 ? powf((r + 0.055f) / 1.055f, 2.4f): r / 12.92f;
+            g = g > 0.04045 ? powf((g + 0.055f) / 1.055f, 2.4f): g / 12.92f;
+            b = b > 0.04045 ? powf((b + 0.055f) / 1.055f, 2.4f): b / 12.92f;
+            float x = 100.f * (r * 0.4124f + g * 0.3576f + b *  0.1805f);
+            float y = 100.f * (r * 0.2126f + g * 0.7152f + b *  0.0722f);
+            float z = 100.f * (r * 0.0193f + g * 0.1192f + b *  0.9505f);
+            // XYZ 2 L-ab
+            x /= 95.047f; 
+            y /= 100.000f; 
+            z /= 108.883f;
+            x = x > 0.008856 ? cbrtf(x): (7.787f * x ) + ( 16.f / 116.f );
+            y = y > 0.008856 ? cbrtf(y): (7.787f * y ) + ( 16.f / 116.f );
+            z = z > 0.008856 ? cbrtf(z): (7.787f * z ) + ( 16.f / 116.f );
 
-    printf("Initial distances\n");
-    #pragma omp parallel for private(c_,r_) shared(densities,buffer)
-    for(int r = 0; r < height; r++) {
-        std:: size_t r_min = fmax(r - kernel_width, 0);
-        std:: size_t r_max = fmin(r + kernel_width + 1, height);
-        for(int c = 0; c < width; c++) {
-            std:: size_t c_min = fmax(c - kernel_width, 0);
-            std:: size_t c_max = fmin(c + kernel_width + 1, width);
-            float *current_pixel_ptr = buffer + width * r * channels + c * channels;
-            for(int r_ = r_min; r_ < r_max; r_++) {
-                for(int c_ = c_min; c_ < c_max; c_++) {
-                    float dist = 0.f;
-                    float t    = 0.f;
-                    for(int channel = 0; channel < 3; channel++) {
-                        t = (current_pixel_ptr[channel] - buffer[r_ * width*3 + c_*3 + channel]);
-                        dist += t*t;
-                    }
-                    t = r-r_;
-                    dist += t*t;
-                    t = c-c_;
-                    dist += t*t;
-                    densities[r * width + c] += expf(dist * inv_kernel_size_sqr);
-                }
-            }
+            float L = (116.f * y ) - 16.f;
+            float a = 500.f * ( x - y );
+            float bb = 200 * ( y - z );
+            buffer[i * channels  + 0] = ratio * L;
+            buffer[i * channels  + 1] = ratio * a;
+            buffer[i * channels  + 2] = ratio * bb;
         }
-    }
+    });
 
-    printf("Medoid shift\n");
-    #pragma omp parallel for private(c_,r_,current_density,closest) shared(densities,buffer,parent,dist_parent)
-    for(int r = 0; r < height; r++) {
-        std:: size_t r_min = fmax(r - kernel_width, 0);
-        std:: size_t r_max = fmin(r + kernel_width + 1, height);
-        for(int c = 0; c < width; c++) {
-            current_density = densities[r*width+c];
-            closest = 1e10;
-            std:: size_t c_min = fmax(c - kernel_width, 0);
-            std:: size_t c_max = fmin(c + kernel_width + 1, width);
-            float *current_pixel_ptr = buffer + width * r * channels + c * channels;
-            for(int r_ = r_min; r_ < r_max; r_++) {
-                for(int c_ = c_min; c_ < c_max; c_++) {
-                    if (densities[r_ * width + c_] > current_density) {
-                        float dist = 0;
+    lab_timer.Stop();
+
+    std::atomic<int> rows_done{0};
+    printf("Initial distances\n");
+    ProfileTimer density_timer(PROFILE_STAGE("quickshift density"));
+    ParallelFor(0, height, 1, [&](std::size_t lo, std::size_t hi) {
+        for(int r = lo; r < hi; r++) {
+            if (progress && progress->cancelled.load()) continue;
+            std:: size_t r_min = fmax(r - kernel_width, 0);
+            std:: size_t r_max = fmin(r + kernel_width + 1, height);
+            for(int c = 0; c < width; c++) {
+                std:: size_t c_min = fmax(c - kernel_width, 0);
+                std:: size_t c_max = fmin(c + kernel_width + 1, width);
+                float *current_pixel_ptr = buffer + width * r * channels + c * channels;
+                for(int r_ = r_min; r_ < r_max; r_++) {
+                    for(int c_ = c_min; c_ < c_max; c_++) {
+                        float dist = 0.f;
                         float t    = 0.f;
                         for(int channel = 0; channel < 3; channel++) {
                             t = (current_pixel_ptr[channel] - buffer[r_ * width*3 + c_*3 + channel]);
@@ -139,18 +117,65 @@ quickshift(Image image, int kernel_size, int max_dist, std::size_t *parent, floa
                         dist += t*t;
                         t = c-c_;
                         dist += t*t;
-                        if (dist < closest) {
-                            closest = dist;
-                            parent[r * width + c] = r_ * width + c_;
+                        densities[r * width + c] += expf(dist * inv_kernel_size_sqr);
+                    }
+                }
+            }
+            if (progress) progress->fraction.store(0.5f * ++rows_done / height);
+        }
+    });
+
+    density_timer.Stop();
+
+    printf("Medoid shift\n");
+    ProfileTimer medoid_timer(PROFILE_STAGE("quickshift medoid"));
+    ParallelFor(0, height, 1, [&](std::size_t lo, std::size_t hi) {
+        float current_density, closest;
+        for(int r = lo; r < hi; r++) {
+            if (progress && progress->cancelled.load()) continue;
+            std:: size_t r_min = fmax(r - kernel_width, 0);
+            std:: size_t r_max = fmin(r + kernel_width + 1, height);
+            for(int c = 0; c < width; c++) {
+                current_density = densities[r*width+c];
+                closest = 1e10;
+                std:: size_t c_min = fmax(c - kernel_width, 0);
+                std:: size_t c_max = fmin(c + kernel_width + 1, width);
+                float *current_pixel_ptr = buffer + width * r * channels + c * channels;
+                for(int r_ = r_min; r_ < r_max; r_++) {
+                    for(int c_ = c_min; c_ < c_max; c_++) {
+                        if (densities[r_ * width + c_] > current_density) {
+                            float dist = 0;
+                            float t    = 0.f;
+                            for(int channel = 0; channel < 3; channel++) {
+                                t = (current_pixel_ptr[channel] - buffer[r_ * width*3 + c_*3 + channel]);
+                                dist += t*t;
+                            }
+                            t = r-r_;
+                            dist += t*t;
+                            t = c-c_;
+                            dist += t*t;
+                            if (dist < closest) {
+                                closest = dist;
+                                parent[r * width + c] = r_ * width + c_;
+                            }
                         }
                     }
                 }
+                dist_parent[r*width+c] = sqrtf(closest);
             }
-            dist_parent[r*width+c] = sqrtf(closest);
+            if (progress) progress->fraction.store(0.5f * ++rows_done / height);
         }
+    });
+    medoid_timer.Stop();
+    free(densities);
+    free(buffer);
+    if (progress && progress->cancelled.load()) {
+        free(dist_parent);
+        return;
     }
 
     printf("Max Dist filter\n");
+    PROFILE_SCOPE("quickshift flatten");
     // remove parents with distance > max_dist
     for(int i = 0; i < width*height; i++) {
         if (dist_parent[i] > (float)max_dist) {
@@ -168,6 +193,7 @@ quickshift(Image image, int kernel_size, int max_dist, std::size_t *parent, floa
             changed |= (parent[j] != old);
         }
     }
+    free(dist_parent);
     double stop = GetTime();
     printf("Quishift took %lf\n s.", stop-start);
 
@@ -0,0 +1,284 @@
+// Registration of the patches against the segmentation background.
+//
+// A patch is rendered alone at the resolution of the background, with the
+// compositor so the global scale and angle apply, and searched for around
+// its current place. The search runs coarse to fine on gray pyramids:
+// normalized cross correlation (cv::matchTemplate) over the whole window at
+// the coarsest level, then a few pixels around the best match at every finer
+// level. The score is the correlation of the final match, in [-1, 1].
+// Patches are independent, each one is registered on its own pool task.
+#define REGISTRATION_MIN_SIZE 24     // Smallest template side at the coarsest level
+#define REGISTRATION_MAX_LEVELS 6
+#define REGISTRATION_REFINE 2        // Pixels searched around the match at finer levels
+#define REGISTRATION_MIN_SCORE 0.3f  // Below, the patch is not moved
+
+struct RegistrationResult {
+    float dx = 0, dy = 0;            // Offset from the expected place, in level 0 pixels
+    float score = -1;
+};
+
+cv::Mat
+RegistrationGray(const Image& im, bool transparent=false) {
+/*
+    R8G8B8A8 to a gray cv::Mat, which owns its pixels. With transparent, im
+    is taken as composited over transparent black (colours scaled by alpha)
+    and the uncovered part is filled with the mean of the covered one: it
+    then correlates with nothing, where black padding would be matched too.
+*/
+    assert(im.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    cv::Mat rgba = cv::Mat(im.height, im.width, CV_8UC4, im.data);
+    cv::Mat gray;
+    cv::cvtColor(rgba, gray, cv::COLOR_RGBA2GRAY);
+    if (!transparent) return gray;
+    const uint8_t *pixels = (const uint8_t*) im.data;
+    std::size_t n = (std::size_t) im.width * im.height;
+    double sum = 0, coverage = 0;
+    for (std::size_t i = 0; i < n; i++) {
+        sum += gray.data[i];
+        coverage += pixels[i * 4 + 3] / 255.0;
+    }
+    double mean = coverage > 0 ? sum / coverage : 0;
+    for (std::size_t i = 0; i < n; i++) {
+        gray.data[i] = fmin(roundf(gray.data[i] + (255 - pixels[i * 4 + 3]) / 255.f * mean), 255);
+    }
+    return gray;
+}
+
+std::vector<cv::Mat>
+RegistrationPyramid(const cv::Mat& gray, int levels) {
+    // Level 0 is gray itself (shared), every next level is half the size.
+    std::vector<cv::Mat> pyramid = {gray};
+    while (pyramid.size() < levels && pyramid.back().cols >= 2 * REGISTRATION_MIN_SIZE && pyramid.back().rows >= 2 * REGISTRATION_MIN_SIZE) {
+        cv::Mat next;
+        cv::pyrDown(pyramid.back(), next);
+        pyramid.push_back(next);
+    }
+    return pyramid;
+}
+
+static bool
+registration_match(const cv::Mat& scene, const cv::Mat& templ, cv::Rect window, cv::Point& best, double& score) {
+    // Best top left of templ with its top left inside window, false if the window is off the scene.
+    int x0 = window.x > 0 ? window.x : 0, y0 = window.y > 0 ? window.y : 0;
+    int x1 = window.x + window.width + templ.cols, y1 = window.y + window.height + templ.rows;
+    x1 = x1 < scene.cols ? x1 : scene.cols;
+    y1 = y1 < scene.rows ? y1 : scene.rows;
+    if (x1 - x0 < templ.cols || y1 - y0 < templ.rows) return false;
+    cv::Mat response;
+    cv::matchTemplate(scene(cv::Rect(x0, y0, x1 - x0, y1 - y0)), templ, response, cv::TM_CCOEFF_NORMED);
+    cv::Point loc;
+    cv::minMaxLoc(response, nullptr, &score, nullptr, &loc);
+    best = cv::Point(x0 + loc.x, y0 + loc.y);
+    return true;
+}
+
+RegistrationResult
+RegisterTemplate(const std::vector<cv::Mat>& scene, const cv::Mat& templ, cv::Point expected, int radius) {
+/*
+    Looks for templ in the scene pyramid with its top left at most radius
+    pixels (level 0) from expected. A template without contrast, or a window
+    falling off the scene, gives a score of -1.
+*/
+    PROFILE_SCOPE("registration match");
+    RegistrationResult result;
+    std::vector<cv::Mat> t = RegistrationPyramid(templ, scene.size());
+    int top = t.size() - 1;
+    int s = 1 << top;
+    cv::Point pos;
+    double score = -1;
+    if (!registration_match(scene[top], t[top], cv::Rect((expected.x - radius) / s, (expected.y - radius) / s, 2 * radius / s + 1, 2 * radius / s + 1), pos, score)) return result;
+    for (int l = top - 1; l >= 0; l--) {
+        cv::Point guess = cv::Point(2 * pos.x, 2 * pos.y);
+        cv::Rect window = cv::Rect(guess.x - REGISTRATION_REFINE, guess.y - REGISTRATION_REFINE, 2 * REGISTRATION_REFINE + 1, 2 * REGISTRATION_REFINE + 1);
+        if (!registration_match(scene[l], t[l], window, pos, score)) return result;
+    }
+    if (!std::isfinite(score)) return result;
+    result.dx = pos.x - expected.x;
+    result.dy = pos.y - expected.y;
+    result.score = score;
+    return result;
+}
+
+// Backgrounds are aligned to the segmentation base as a whole: an affine
+// warp from base pixels to background pixels is refined with ECC
+// (cv::findTransformECC) from the coarsest pyramid level down to the first
+// level under ALIGNMENT_MAX_SIDE. ECC maximizes a correlation that ignores
+// brightness and contrast, so optical and polarized images still match.
+// The warp starts from the current placement, so every run refines the
+// previous one.
+#define ALIGNMENT_MAX_SIDE 2048      // Finest level used, in pixels on the longest side
+#define ALIGNMENT_ITERATIONS 60
+#define ALIGNMENT_EPS 1e-5
+
+void
+AffineCompose(const double a[6], const double b[6], double out[6]) {
+    // out = a after b, both [m00 m01 tx m10 m11 ty].
+    double r[6] = {
+        a[0] * b[0] + a[1] * b[3], a[0] * b[1] + a[1] * b[4], a[0] * b[2] + a[1] * b[5] + a[2],
+        a[3] * b[0] + a[4] * b[3], a[3] * b[1] + a[4] * b[4], a[3] * b[2] + a[4] * b[5] + a[5]};
+    memcpy(out, r, sizeof(r));
+}
+
+bool
+AffineInvert(const double a[6], double out[6]) {
+    double det = a[0] * a[4] - a[1] * a[3];
+    if (fabs(det) < 1e-12) return false;
+    double r[6] = {a[4] / det, -a[1] / det, 0, -a[3] / det, a[0] / det, 0};
+    r[2] = -(r[0] * a[2] + r[1] * a[5]);
+    r[5] = -(r[3] * a[2] + r[4] * a[5]);
+    memcpy(out, r, sizeof(r));
+    return true;
+}
+
+float
+AlignECC(const std::vector<cv::Mat>& base, const std::vector<cv::Mat>& moving, double warp[6], int coarsest) {
+/*
+    Refines warp (base level 0 pixels to moving level 0 pixels) from level
+    coarsest down. Returns the correlation of the last level that converged,
+    NAN if none did; warp is only updated by levels that converged.
+*/
+    PROFILE_SCOPE("alignment ecc");
+    int levels = base.size() < moving.size() ? base.size() : moving.size();
+    int finest = 0;
+    while (finest + 1 < levels && MAXVAL(base[finest].cols, base[finest].rows) > ALIGNMENT_MAX_SIDE) finest++;
+    coarsest = coarsest < levels - 1 ? coarsest : levels - 1;
+    coarsest = coarsest > finest ? coarsest : finest;
+    float score = NAN;
+    cv::TermCriteria criteria = cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, ALIGNMENT_ITERATIONS, ALIGNMENT_EPS);
+    for (int l = coarsest; l >= finest; l--) {
+        // Same linear part at every level, the translation shrinks with the pixels.
+        double s = 1 << l;
+        cv::Mat m = cv::Mat(2, 3, CV_32F);
+        for (int k = 0; k < 6; k++) m.at<float>(k / 3, k % 3) = k % 3 == 2 ? warp[k] / s : warp[k];
+        try {
+            score = cv::findTransformECC(base[l], moving[l], m, cv::MOTION_AFFINE, criteria, cv::Mat(), 5);
+        } catch (const cv::Exception& e) {
+            continue; // Did not converge at this level, keep the warp
+        }
+        for (int k = 0; k < 6; k++) warp[k] = k % 3 == 2 ? m.at<float>(k / 3, k % 3) * s : m.at<float>(k / 3, k % 3);
+    }
+    return score;
+}
+
+// Global refinement of the patch positions from their overlaps. The offset
+// between two overlapping patches is measured by phase correlation
+// (cv::phaseCorrelate) of the two renders of their common area. All the
+// offsets are then reconciled at once by weighted least squares: every pair
+// asks for a relative correction, a weak prior keeps each patch near its
+// place (and patches without pairs where they are). The normal equations
+// form a sparse graph Laplacian, solved by conjugate gradients, a few times
+// over with the pairs far off the solution weighted down (Cauchy weights),
+// so a wrong measurement does not drag its neighbours along.
+#define PAIR_MIN_OVERLAP 32          // Pixels on each side of the common area
+#define PAIR_MAX_SIDE 1024           // Common areas are measured at most this large
+#define PAIR_MIN_RESPONSE 0.05f      // Phase correlation peak below which a pair is ignored
+#define PAIR_PRIOR 1e-3              // Weight keeping every patch near its place
+#define PAIR_RESIDUAL 2.0            // Pixels of disagreement at which a pair counts half
+#define PAIR_PASSES 6
+
+struct PatchPair {
+    int i, j;
+    float dx, dy;                    // Measured offset of j relative to i, in pixels
+    float weight;
+};
+
+bool
+MeasurePairOffset(CompositeLayer a, CompositeLayer b, Rectangle overlap, PatchPair& pair) {
+/*
+    a and b are two patches placed in the same pixel frame, overlap the
+    area they share. Renders both there (shrunk to PAIR_MAX_SIDE) and
+    measures how far b's content is shifted from a's.
+*/
+    float shrink = fminf(1.f, PAIR_MAX_SIDE / fmaxf(overlap.width, overlap.height));
+    int w = overlap.width * shrink, h = overlap.height * shrink;
+    if (w < PAIR_MIN_OVERLAP || h < PAIR_MIN_OVERLAP) return false;
+    cv::Mat gray[2];
+    CompositeLayer *layers[2] = {&a, &b};
+    for (int k = 0; k < 2; k++) {
+        CompositeLayer& l = *layers[k];
+        l.dest = (Rectangle) {(l.dest.x - overlap.x) * shrink, (l.dest.y - overlap.y) * shrink, l.dest.width * shrink, l.dest.height * shrink};
+        Image render = (Image) {malloc((std::size_t) w * h * 4), w, h, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+        assert(render.data);
+        CompositeLayers(render, {l}, (Rectangle) {0, 0, (float) w, (float) h}, BLANK, COMPOSITE_AREA);
+        RegistrationGray(render).convertTo(gray[k], CV_32F);
+        UnloadImage(render);
+    }
+    cv::Mat window;
+    cv::createHanningWindow(window, cv::Size(w, h), CV_32F);
+    double response = 0;
+    cv::Point2d shift = cv::phaseCorrelate(gray[0], gray[1], window, &response);
+    if (!(response >= PAIR_MIN_RESPONSE)) return false;
+    pair.dx = shift.x / shrink;
+    pair.dy = shift.y / shrink;
+    pair.weight = response;
+    return true;
+}
+
+static void
+pairs_solve(int n, const std::vector<PatchPair>& pairs, const std::vector<double>& weights, int axis, std::vector<double>& u) {
+    // Conjugate gradients on (prior I + sum w (e_j - e_i)(e_j - e_i)^T) u = sum w r (e_j - e_i), r = -offset.
+    auto apply = [&](const std::vector<double>& v, std::vector<double>& out) {
+        for (int k = 0; k < n; k++) out[k] = PAIR_PRIOR * v[k];
+        for (std::size_t p = 0; p < pairs.size(); p++) {
+            double f = weights[p] * (v[pairs[p].j] - v[pairs[p].i]);
+            out[pairs[p].j] += f;
+            out[pairs[p].i] -= f;
+        }
+    };
+    std::vector<double> b(n, 0.0), r(n), p(n), q(n);
+    for (std::size_t k = 0; k < pairs.size(); k++) {
+        double f = -weights[k] * (axis == 0 ? pairs[k].dx : pairs[k].dy);
+        b[pairs[k].j] += f;
+        b[pairs[k].i] -= f;
+    }
+    u.assign(n, 0.0);
+    r = b;
+    p = r;
+    double rr = 0;
+    for (int k = 0; k < n; k++) rr += r[k] * r[k];
+    double bb = rr;
+    for (int it = 0; it < 4 * n + 100 && rr > 1e-12 * bb && rr > 1e-20; it++) {
+        apply(p, q);
+        double pq = 0;
+        for (int k = 0; k < n; k++) pq += p[k] * q[k];
+        double alpha = rr / pq;
+        for (int k = 0; k < n; k++) {
+            u[k] += alpha * p[k];
+            r[k] -= alpha * q[k];
+        }
+        double rr_next = 0;
+        for (int k = 0; k < n; k++) rr_next += r[k] * r[k];
+        for (int k = 0; k < n; k++) p[k] = r[k] + rr_next / rr * p[k];
+        rr = rr_next;
+    }
+}
+
+double
+SolvePairCorrections(int n, const std::vector<PatchPair>& pairs, std::vector<double>& ux, std::vector<double>& uy, int *inliers=nullptr) {
+/*
+    Corrections (in pixels) to add to the positions of n patches so that the
+    measured pairs agree. Returns the RMS disagreement of the inlier pairs,
+    those within 3 PAIR_RESIDUAL of the solution.
+*/
+    PROFILE_SCOPE("pairs solve");
+    std::vector<double> weights(pairs.size());
+    for (std::size_t p = 0; p < pairs.size(); p++) weights[p] = pairs[p].weight;
+    double sum = 0;
+    int kept = 0;
+    for (int pass = 0; pass < PAIR_PASSES; pass++) {
+        pairs_solve(n, pairs, weights, 0, ux);
+        pairs_solve(n, pairs, weights, 1, uy);
+        sum = 0;
+        kept = 0;
+        for (std::size_t p = 0; p < pairs.size(); p++) {
+            const PatchPair& q = pairs[p];
+            double e = hypot(ux[q.j] - ux[q.i] + q.dx, uy[q.j] - uy[q.i] + q.dy) / PAIR_RESIDUAL;
+            weights[p] = q.weight / (1 + e * e);
+            if (e > 3) continue;
+            sum += e * e;
+            kept++;
+        }
+    }
+    if (inliers) *inliers = kept;
+    return kept > 0 ? PAIR_RESIDUAL * sqrt(sum / kept) : 0;
+}
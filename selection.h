@@ -0,0 +1,75 @@
+// Highlight of the selected segments, one mask for the whole selection.
+//
+// The mask has the resolution of the label map and is displayed through a
+// tile pyramid like the boundaries. Selecting or deselecting a segment only
+// rewrites the pixels of its bounding box, and only the tiles under it are
+// uploaded again, so the cost of a selection does not grow with its size and
+// drawing it is a handful of tiles whatever the number of segments.
+
+struct SelectionLayer {
+    Image mask = {0};               // Gray-alpha, alpha set on selected pixels
+    Rectangle painted = {0};        // Bounding box of everything set since the last clear
+    TilePyramid *pyramid = nullptr;
+};
+
+void
+UnloadSelectionLayer(SelectionLayer& layer) {
+    UnloadTilePyramid(layer.pyramid);
+    if (layer.mask.data) UnloadImage(layer.mask);
+    layer = SelectionLayer();
+}
+
+static void
+selection_layer_fit(SelectionLayer& layer, int nx, int ny) {
+    // (Re)allocates the mask when the label map size changed.
+    if (layer.mask.data && layer.mask.width == nx && layer.mask.height == ny) return;
+    UnloadSelectionLayer(layer);
+    layer.mask = GenImageColor(nx, ny, BLANK);
+    ImageFormat(&layer.mask, PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA);
+    layer.pyramid = TilePyramidCreate(layer.mask, TILE_REDUCE_MAX); // Small segments stay visible zoomed out
+}
+
+void
+SelectionLayerSet(SelectionLayer& layer, const std::size_t *labels, int nx, int ny, const SegmentProperties& seg, bool selected) {
+    // Shows (or hides) the pixels of segment seg.id, they all lie in seg.bbox.
+    selection_layer_fit(layer, nx, ny);
+    Rectangle r = seg.bbox;
+    if (r.width <= 0 || r.height <= 0) return;
+    uint8_t *pixels = (uint8_t*) layer.mask.data;
+    uint8_t alpha = selected ? 128 : 0;
+    ParallelFor(r.y, r.y + r.height, 16, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t y = lo; y < hi; y++) {
+            for (std::size_t x = r.x; x < r.x + r.width; x++) {
+                if (labels[y * nx + x] != seg.id) continue;
+                pixels[(y * nx + x) * 2 + 0] = 255;
+                pixels[(y * nx + x) * 2 + 1] = alpha;
+            }
+        }
+    });
+    if (selected) {
+        layer.painted = layer.painted.width > 0 ? (Rectangle) {
+            fminf(layer.painted.x, r.x), fminf(layer.painted.y, r.y),
+            fmaxf(layer.painted.x + layer.painted.width, r.x + r.width) - fminf(layer.painted.x, r.x),
+            fmaxf(layer.painted.y + layer.painted.height, r.y + r.height) - fminf(layer.painted.y, r.y)} : r;
+    }
+    TilePyramidUpdate(layer.pyramid, r);
+}
+
+void
+SelectionLayerClear(SelectionLayer& layer) {
+    // Hides everything, e.g. when the labels change under the selection.
+    Rectangle r = layer.painted;
+    if (!layer.mask.data || r.width <= 0) return;
+    uint8_t *pixels = (uint8_t*) layer.mask.data;
+    int nx = layer.mask.width;
+    ParallelFor(r.y, r.y + r.height, 16, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t y = lo; y < hi; y++) memset(pixels + (y * nx + (std::size_t) r.x) * 2, 0, (std::size_t) r.width * 2);
+    });
+    layer.painted = (Rectangle) {0};
+    TilePyramidUpdate(layer.pyramid, r);
+}
+
+void
+DrawSelectionLayer(SelectionLayer& layer, Rectangle dest, Color tint, Camera2D camera) {
+    if (layer.painted.width > 0) DrawTilePyramid(layer.pyramid, dest, 0, tint, camera);
+}
@@ -0,0 +1,192 @@
+// Brush strokes on the drawing board.
+//
+// Mouse samples are joined by discs spaced half a radius apart, so fast moves
+// leave a continuous stroke instead of isolated dots. Every disc is rasterized
+// from a table of horizontal spans, computed once per brush size.
+//
+// Strokes are a coverage mask kept sparse: 64x64 pixel tiles of one bit per
+// pixel, allocated the first time they are painted. Memory, display and
+// commits scale with the painted area, not with the background. Each tile has
+// its own small texture, refreshed only when the tile changed.
+#define STROKE_TILE 64
+
+struct StrokeTile {
+    uint64_t rows[STROKE_TILE]; // Bit x of rows[y] covers pixel (x, y) of the tile
+    Texture2D tex;
+    bool dirty;
+};
+
+struct StrokeTileKV {
+    uint64_t key;               // ty << 32 | tx
+    StrokeTile *value;
+};
+
+struct StrokeLayer {
+    int width = 0;
+    int height = 0;
+    StrokeTileKV *tiles = nullptr;
+};
+
+struct StrokeEngine {
+    int radius = -1;
+    std::vector<int> spans;  // Half-width of row dy + radius of the disc, -1 when empty
+    bool drawing = false;
+    float last_x, last_y;    // Previous sample, in layer pixels
+};
+
+static inline uint64_t
+stroke_tile_key(int tx, int ty) {
+    return (uint64_t) ty << 32 | (uint32_t) tx;
+}
+
+static StrokeTile *
+stroke_layer_tile(StrokeLayer& layer, int tx, int ty, bool create) {
+    uint64_t key = stroke_tile_key(tx, ty);
+    int loc = hmgeti(layer.tiles, key);
+    if (loc >= 0) return layer.tiles[loc].value;
+    if (!create) return nullptr;
+    StrokeTile *tile = (StrokeTile*) calloc(1, sizeof(StrokeTile));
+    assert(tile);
+    hmput(layer.tiles, key, tile);
+    return tile;
+}
+
+template<typename Mask>
+static void
+stroke_layer_span(StrokeLayer& layer, int y, int x0, int x1, bool erase, Mask mask) {
+    // Sets (or clears) pixels [x0, x1] of row y that mask(index) accepts.
+    int ty = y / STROKE_TILE, ry = y % STROKE_TILE;
+    for (int tx = x0 / STROKE_TILE; tx <= x1 / STROKE_TILE; tx++) {
+        StrokeTile *tile = stroke_layer_tile(layer, tx, ty, !erase);
+        if (!tile) continue;
+        int ox = tx * STROKE_TILE;
+        int a = MAXVAL(x0, ox) - ox, b = (x1 < ox + STROKE_TILE - 1 ? x1 : ox + STROKE_TILE - 1) - ox;
+        uint64_t bits = 0;
+        std::size_t row = (std::size_t) y * layer.width + ox;
+        for (int x = a; x <= b; x++) bits |= (uint64_t) mask(row + x) << x;
+        if (erase) tile->rows[ry] &= ~bits;
+        else tile->rows[ry] |= bits;
+        tile->dirty |= bits != 0;
+    }
+}
+
+static void
+stroke_set_radius(StrokeEngine& s, int radius) {
+    if (radius == s.radius) return;
+    s.radius = radius;
+    s.spans.assign(2 * radius + 1, -1);
+    for (int dy = -radius; dy <= radius; dy++) {
+        // Largest dx with dx^2 + dy^2 < radius^2, like the former sqrtf test.
+        int h = -1;
+        while ((h + 1) * (h + 1) + dy * dy < radius * radius) h++;
+        s.spans[dy + radius] = h;
+    }
+}
+
+template<typename Mask>
+static void
+stroke_disc(StrokeEngine& s, StrokeLayer& layer, int cx, int cy, bool erase, Mask mask) {
+    int r = s.radius;
+    int y0 = MAXVAL(cy - r, 0), y1 = cy + r < layer.height - 1 ? cy + r : layer.height - 1;
+    for (int y = y0; y <= y1; y++) {
+        int h = s.spans[y - cy + r];
+        if (h < 0) continue;
+        int x0 = MAXVAL(cx - h, 0), x1 = cx + h < layer.width - 1 ? cx + h : layer.width - 1;
+        if (x1 >= x0) stroke_layer_span(layer, y, x0, x1, erase, mask);
+    }
+}
+
+template<typename Mask>
+void
+StrokeTo(StrokeEngine& s, StrokeLayer& layer, float x, float y, int radius, bool erase, Mask mask) {
+/*
+    Extends the current stroke (or starts one) up to the sample (x, y), in layer pixels.
+    mask(i) tells whether the pixel of index i may be painted.
+*/
+    stroke_set_radius(s, radius);
+    if (!s.drawing) {
+        s.drawing = true;
+        s.last_x = x;
+        s.last_y = y;
+        stroke_disc(s, layer, roundf(x), roundf(y), erase, mask);
+        return;
+    }
+    float dx = x - s.last_x, dy = y - s.last_y;
+    float step = fmax(radius / 2.f, 1.f);
+    int n = ceilf(sqrtf(dx * dx + dy * dy) / step);
+    for (int k = 1; k <= n; k++) {
+        stroke_disc(s, layer, roundf(s.last_x + dx * k / n), roundf(s.last_y + dy * k / n), erase, mask);
+    }
+    s.last_x = x;
+    s.last_y = y;
+}
+
+void
+StrokeEnd(StrokeEngine& s) {
+    s.drawing = false;
+}
+
+template<typename Visit>
+Rectangle
+StrokeLayerForEach(StrokeLayer& layer, Visit visit) {
+    // Calls visit(index) on every covered pixel, returns their bounding box.
+    int xmin = layer.width, ymin = layer.height, xmax = -1, ymax = -1;
+    for (int t = 0; t < hmlen(layer.tiles); t++) {
+        int tx = (uint32_t) layer.tiles[t].key, ty = layer.tiles[t].key >> 32;
+        StrokeTile *tile = layer.tiles[t].value;
+        for (int ry = 0; ry < STROKE_TILE; ry++) {
+            uint64_t bits = tile->rows[ry];
+            if (!bits) continue;
+            int y = ty * STROKE_TILE + ry;
+            ymin = y < ymin ? y : ymin; ymax = y > ymax ? y : ymax;
+            xmin = fmin(xmin, tx * STROKE_TILE + __builtin_ctzll(bits));
+            xmax = fmax(xmax, tx * STROKE_TILE + 63 - __builtin_clzll(bits));
+            while (bits) {
+                int x = tx * STROKE_TILE + __builtin_ctzll(bits);
+                visit((std::size_t) y * layer.width + x);
+                bits &= bits - 1;
+            }
+        }
+    }
+    if (xmax < 0) return (Rectangle) {0};
+    return (Rectangle) {(float) xmin, (float) ymin, (float) (xmax - xmin + 1), (float) (ymax - ymin + 1)};
+}
+
+void
+StrokeLayerClear(StrokeLayer& layer) {
+    for (int t = 0; t < hmlen(layer.tiles); t++) {
+        StrokeTile *tile = layer.tiles[t].value;
+        if (tile->tex.id > 0) UnloadTexture(tile->tex);
+        free(tile);
+    }
+    hmfree(layer.tiles);
+}
+
+void
+DrawStrokeLayer(StrokeLayer& layer, Rectangle dest, Color tint) {
+    // Covered pixels in tint, tiles uploaded again only if painted since the last frame.
+    if (layer.width == 0 || layer.height == 0) return;
+    float sx = dest.width / layer.width, sy = dest.height / layer.height;
+    static uint8_t pixels[STROKE_TILE * STROKE_TILE * 2];
+    for (int t = 0; t < hmlen(layer.tiles); t++) {
+        int tx = (uint32_t) layer.tiles[t].key, ty = layer.tiles[t].key >> 32;
+        StrokeTile *tile = layer.tiles[t].value;
+        if (tile->dirty || tile->tex.id == 0) {
+            for (int y = 0; y < STROKE_TILE; y++) {
+                for (int x = 0; x < STROKE_TILE; x++) {
+                    pixels[(y * STROKE_TILE + x) * 2 + 0] = 255;
+                    pixels[(y * STROKE_TILE + x) * 2 + 1] = (tile->rows[y] >> x) & 1 ? 255 : 0;
+                }
+            }
+            if (tile->tex.id > 0) UpdateTexture(tile->tex, pixels);
+            else tile->tex = LoadTextureFromImage((Image) {pixels, STROKE_TILE, STROKE_TILE, 1, PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA});
+            tile->dirty = false;
+        }
+        // Border tiles stick out of the layer, their outside part is not drawn.
+        int ox = tx * STROKE_TILE, oy = ty * STROKE_TILE;
+        float w = layer.width - ox < STROKE_TILE ? layer.width - ox : STROKE_TILE;
+        float h = layer.height - oy < STROKE_TILE ? layer.height - oy : STROKE_TILE;
+        Rectangle tile_dest = {dest.x + ox * sx, dest.y + oy * sy, w * sx, h * sy};
+        DrawTexturePro(tile->tex, (Rectangle) {0, 0, w, h}, tile_dest, (Vector2) {0, 0}, 0, tint);
+    }
+}
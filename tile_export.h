@@ -0,0 +1,172 @@
+// Tiled, multi-resolution export, for viewers that open large maps by tile.
+//
+//   dir/index.json                 sizes, tile size, pixel format, levels
+//   dir/<level>/<col>_<row>.png    level 0 is full resolution
+//
+// The full resolution image is never made: a producer renders the level 0
+// tiles (e.g. by compositing their region), one row of tiles at a time, in
+// parallel. Every level halves the previous one (as in tile_pyramid.h) down
+// to a single tile, and is built from the rows of the level below as they
+// are written, so only one band of TILE_EXPORT_SIZE rows per level is in
+// memory, about two bands of level 0 in all.
+//
+// Label maps are written as "label32": the low 32 bits of each label in the
+// R, G, B and A bytes, least significant first. Their levels keep the top
+// left label of every 2x2 block, never a mix of labels.
+#define TILE_EXPORT_SIZE 256
+
+// Fills tile (allocated, its size and format set) with the level 0 pixels
+// from (x, y). Called from several threads at once.
+typedef std::function<void(Image& tile, int x, int y)> TileProducer;
+
+TileProducer
+TilesFromImage(Image source) {
+    // Copies of an image in memory, which must not change during the export.
+    return [source](Image& tile, int x, int y) {
+        int bpp = source.format == PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA ? 2 : 4;
+        for (int j = 0; j < tile.height; j++) {
+            memcpy((uint8_t*) tile.data + (std::size_t) j * tile.width * bpp,
+                   (const uint8_t*) source.data + ((std::size_t) (y + j) * source.width + x) * bpp, (std::size_t) tile.width * bpp);
+        }
+    };
+}
+
+TileProducer
+TilesFromLabels(const std::size_t *labels, int nx) {
+    // R8G8B8A8 label32 tiles of a label map with nx columns, see above.
+    return [labels, nx](Image& tile, int x, int y) {
+        uint8_t *pixels = (uint8_t*) tile.data;
+        for (int j = 0; j < tile.height; j++) {
+            for (int i = 0; i < tile.width; i++) {
+                std::size_t label = labels[(std::size_t) (y + j) * nx + x + i];
+                for (int k = 0; k < 4; k++) pixels[((std::size_t) j * tile.width + i) * 4 + k] = (label >> (8 * k)) & 255;
+            }
+        }
+    };
+}
+
+TileProducer
+TilesFromLayers(std::vector<CompositeLayer> layers, Color clear, CompositeFilter filter) {
+    // R8G8B8A8 tiles of the layers composited over clear (see compositor.h), layer images must outlive the export.
+    return [layers, clear, filter](Image& tile, int x, int y) {
+        std::vector<CompositeLayer> shifted = layers;
+        for (auto & l : shifted) {
+            l.dest.x -= x;
+            l.dest.y -= y;
+        }
+        CompositeLayers(tile, shifted, (Rectangle) {0, 0, (float) tile.width, (float) tile.height}, clear, filter);
+    };
+}
+
+static bool
+tile_export_row(const Image& band, int k, int row, const std::string& dir, int bpp, JobProgress *progress, std::atomic<int>& written, int total) {
+    // Writes band, one row of tiles of level k, returns false when cancelled or a file failed.
+    int cols = (band.width + TILE_EXPORT_SIZE - 1) / TILE_EXPORT_SIZE;
+    std::atomic<bool> ok{true};
+    ParallelFor(0, cols, 1, [&](std::size_t lo, std::size_t hi) {
+        for (std::size_t col = lo; col < hi && ok.load(); col++) {
+            if (progress && progress->cancelled.load()) return ok.store(false);
+            int x0 = col * TILE_EXPORT_SIZE;
+            int w = x0 + TILE_EXPORT_SIZE < band.width ? TILE_EXPORT_SIZE : band.width - x0;
+            Image tile = {malloc((std::size_t) w * band.height * bpp), w, band.height, 1, band.format};
+            for (int y = 0; y < band.height; y++) {
+                memcpy((uint8_t*) tile.data + (std::size_t) y * w * bpp,
+                       (const uint8_t*) band.data + ((std::size_t) y * band.width + x0) * bpp, (std::size_t) w * bpp);
+            }
+            if (!ExportImage(tile, fmt::format("{}/{}/{}_{}.png", dir, k, col, row).c_str())) ok.store(false);
+            UnloadImage(tile);
+            if (progress) progress->fraction.store((float) ++written / total);
+        }
+    });
+    return ok.load();
+}
+
+bool
+ExportTiles(int width, int height, int format, const TileProducer& produce, std::string dir,
+            TileReduce reduce=TILE_REDUCE_MEAN, JobProgress *progress=nullptr, std::string format_name="rgba") {
+/*
+    Writes a width x height image of format (R8G8B8A8 or gray-alpha), made
+    tile by tile by produce, as a tile pyramid in dir, created if needed.
+    format_name names the pixel encoding in index.json. Returns false when
+    cancelled through progress or when a file could not be written; tiles
+    written so far are left on disk.
+*/
+    TRACE_SCOPE("export tiles", "io");
+    assert(format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 || format == PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    int bpp = format == PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA ? 2 : 4;
+    nlohmann::json index;
+    index["width"] = width;
+    index["height"] = height;
+    index["tile_size"] = TILE_EXPORT_SIZE;
+    index["format"] = format_name;
+    index["channels"] = bpp;
+    index["path"] = "{level}/{col}_{row}.png";
+    index["levels"] = nlohmann::json::array();
+    std::vector<Image> bands;           // Rows of each level not written yet, the height is the rows filled
+    std::vector<int> done;              // Rows of each level written
+    int total = 0;
+    for (int w = width, h = height;; w = (w + 1) / 2, h = (h + 1) / 2) {
+        int cols = (w + TILE_EXPORT_SIZE - 1) / TILE_EXPORT_SIZE, rows = (h + TILE_EXPORT_SIZE - 1) / TILE_EXPORT_SIZE;
+        if (mkdir(fmt::format("{}/{}", dir, bands.size()).c_str(), 0755) != 0 && errno != EEXIST) return false;
+        index["levels"].push_back({{"level", bands.size()}, {"width", w}, {"height", h}, {"cols", cols}, {"rows", rows}});
+        total += cols * rows;
+        bands.push_back((Image) {malloc((std::size_t) w * TILE_EXPORT_SIZE * bpp), w, 0, 1, format});
+        assert(bands.back().data);
+        done.push_back(0);
+        if (w <= TILE_EXPORT_SIZE && h <= TILE_EXPORT_SIZE) break;
+    }
+    std::atomic<int> written{0};
+    // Writes the band of level k and halves it into the next one, which is written in turn once full or complete.
+    std::function<bool(int)> flush = [&](int k) {
+        Image& band = bands[k];
+        if (!tile_export_row(band, k, done[k] / TILE_EXPORT_SIZE, dir, bpp, progress, written, total)) return false;
+        done[k] += band.height;
+        if (k + 1 < bands.size()) {
+            Image& next = bands[k + 1];
+            Image half = next;
+            half.height = (band.height + 1) / 2;
+            half.data = (uint8_t*) next.data + (std::size_t) next.height * next.width * bpp;
+            tile_downsample_rect(band, half, 0, 0, half.width, half.height, bpp, reduce);
+            next.height += half.height;
+        }
+        band.height = 0;
+        if (k + 1 == bands.size()) return true;
+        int next_height = index["levels"][k + 1]["height"];
+        if (bands[k + 1].height < TILE_EXPORT_SIZE && done[k + 1] + bands[k + 1].height < next_height) return true;
+        return flush(k + 1);
+    };
+    bool ok = true;
+    int cols = (width + TILE_EXPORT_SIZE - 1) / TILE_EXPORT_SIZE;
+    for (int y = 0; ok && y < height; y += TILE_EXPORT_SIZE) {
+        Image& band = bands[0];
+        band.height = y + TILE_EXPORT_SIZE < height ? TILE_EXPORT_SIZE : height - y;
+        ParallelFor(0, cols, 1, [&](std::size_t lo, std::size_t hi) {
+            for (std::size_t col = lo; col < hi; col++) {
+                if (progress && progress->cancelled.load()) return;
+                int x0 = col * TILE_EXPORT_SIZE;
+                int w = x0 + TILE_EXPORT_SIZE < width ? TILE_EXPORT_SIZE : width - x0;
+                Image tile = {malloc((std::size_t) w * band.height * bpp), w, band.height, 1, format};
+                assert(tile.data);
+                produce(tile, x0, y);
+                for (int j = 0; j < band.height; j++) {
+                    memcpy((uint8_t*) band.data + ((std::size_t) j * width + x0) * bpp,
+                           (const uint8_t*) tile.data + (std::size_t) j * w * bpp, (std::size_t) w * bpp);
+                }
+                UnloadImage(tile);
+            }
+        });
+        ok = flush(0);
+    }
+    for (auto & band : bands) free(band.data);
+    if (!ok) return false;
+    std::ofstream f(dir + "/index.json");
+    f << index.dump(2);
+    return f.good();
+}
+
+bool
+ExportTiles(Image source, std::string dir, TileReduce reduce=TILE_REDUCE_MEAN, JobProgress *progress=nullptr, std::string format_name="rgba") {
+    // An image in memory, R8G8B8A8 or gray-alpha, not modified.
+    return ExportTiles(source.width, source.height, source.format, TilesFromImage(source), dir, reduce, progress, format_name);
+}
@@ -0,0 +1,338 @@
+// Tiled, multi-resolution textures for images larger than the GPU allows.
+//
+// Level 0 is the source image (not owned, must outlive the pyramid), every
+// next level halves it, down to a single tile. Coarser levels are computed on
+// the thread pool; tiles are uploaded lazily, only when they are in view,
+// from the level matching the zoom, and unloaded when unused for a while.
+// Edits only re-upload the rectangle they touched in each resident tile.
+// Resident tiles are listed, so a frame costs what is on screen and in GPU
+// memory, whatever the image size. A tile waiting for its upload is drawn
+// from a resident coarser level meanwhile. Eviction sweeps every live
+// pyramid once per frame (TilePyramidsFrameEnd), so a pyramid no longer
+// drawn gives its textures back too. Pyramids own textures: they are made,
+// drawn and unloaded on the main thread.
+#define TILE_SIZE 512
+#define TILE_MAX_LEVELS 16
+#define TILE_UPLOADS_PER_FRAME 16
+#define TILE_EVICT_FRAMES 120
+
+enum TileReduce { TILE_REDUCE_MEAN, TILE_REDUCE_MAX, TILE_REDUCE_NEAREST };
+enum TileBuild { TILE_BUILD_QUEUED, TILE_BUILD_RUNNING, TILE_BUILD_DONE };
+
+struct PyramidTile {
+    Texture2D tex = {0};
+    int last_used = 0;
+    Rectangle dirty = {0}; // Tile pixels changed since the upload
+};
+
+struct TilePyramid {
+    int width, height;
+    int format;
+    int bytes_per_pixel;
+    TileReduce reduce;
+    int num_levels;
+    Image levels[TILE_MAX_LEVELS];
+    std::atomic<int> levels_ready;
+    std::atomic<bool> cancel;
+    std::shared_ptr<std::atomic<int>> build;    // TileBuild, shared with the queued task, which may outlive the pyramid
+    std::vector<PyramidTile> tiles[TILE_MAX_LEVELS];
+    int tiles_x[TILE_MAX_LEVELS];
+    int tiles_y[TILE_MAX_LEVELS];
+    std::vector<std::pair<int, int>> resident;  // (level, tile) of the tiles with a texture
+};
+
+struct TilePyramids {
+    std::vector<TilePyramid*> live;             // Created and not unloaded yet
+    int frame = 0;
+};
+
+TilePyramids&
+GetTilePyramids() {
+    static TilePyramids pyramids;
+    return pyramids;
+}
+
+static void
+tile_downsample_rect(const Image& src, Image& dst, int x0, int y0, int x1, int y1, int bpp, TileReduce reduce) {
+    // Destination pixels [x0, x1) x [y0, y1) from 2x2 source blocks, clamped at the border.
+    const uint8_t *in = (const uint8_t*) src.data;
+    uint8_t *out = (uint8_t*) dst.data;
+    ParallelFor(y0, y1, 32, [&](std::size_t lo, std::size_t hi) {
+        for (int y = lo; y < hi; y++) {
+            int sy0 = 2 * y, sy1 = 2 * y + 1 < src.height ? 2 * y + 1 : 2 * y;
+            for (int x = x0; x < x1; x++) {
+                int sx0 = 2 * x, sx1 = 2 * x + 1 < src.width ? 2 * x + 1 : 2 * x;
+                const uint8_t *a = in + ((std::size_t) sy0 * src.width + sx0) * bpp;
+                const uint8_t *b = in + ((std::size_t) sy0 * src.width + sx1) * bpp;
+                const uint8_t *c = in + ((std::size_t) sy1 * src.width + sx0) * bpp;
+                const uint8_t *d = in + ((std::size_t) sy1 * src.width + sx1) * bpp;
+                uint8_t *o = out + ((std::size_t) y * dst.width + x) * bpp;
+                for (int k = 0; k < bpp; k++) {
+                    if (reduce == TILE_REDUCE_MAX) o[k] = MAXVAL(MAXVAL(a[k], b[k]), MAXVAL(c[k], d[k]));
+                    else if (reduce == TILE_REDUCE_NEAREST) o[k] = a[k];
+                    else o[k] = (a[k] + b[k] + c[k] + d[k] + 2) / 4;
+                }
+            }
+        }
+    });
+}
+
+static void
+tile_pyramid_build(TilePyramid *p) {
+    TRACE_SCOPE("pyramid build", "pool");
+    for (int k = 1; k < p->num_levels && !p->cancel.load(); k++) {
+        Image& src = p->levels[k-1];
+        Image& dst = p->levels[k];
+        tile_downsample_rect(src, dst, 0, 0, dst.width, dst.height, p->bytes_per_pixel, p->reduce);
+        p->levels_ready.store(k + 1);
+    }
+    p->build->store(TILE_BUILD_DONE);
+}
+
+static void
+tile_pyramid_wait(TilePyramid *p, bool run=true) {
+/*
+    Returns once no build is pending. A build no worker has taken yet is
+    claimed and run here (or dropped when !run), so the main thread never
+    waits for a worker busy with a job.
+*/
+    int queued = TILE_BUILD_QUEUED;
+    if (p->build->compare_exchange_strong(queued, run ? TILE_BUILD_RUNNING : TILE_BUILD_DONE)) {
+        if (run) tile_pyramid_build(p);
+        return;
+    }
+    while (p->build->load() != TILE_BUILD_DONE) std::this_thread::yield();
+}
+
+bool
+TilePyramidBusy(TilePyramid *p) {
+    // A worker is building the coarser levels, waiting for it would stall.
+    return p && p->build->load() == TILE_BUILD_RUNNING;
+}
+
+TilePyramid *
+TilePyramidCreate(Image source, TileReduce reduce=TILE_REDUCE_MEAN) {
+    assert(source.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 || source.format == PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA);
+    TilePyramid *p = new TilePyramid();
+    p->width = source.width;
+    p->height = source.height;
+    p->format = source.format;
+    p->bytes_per_pixel = source.format == PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA ? 2 : 4;
+    p->reduce = reduce;
+    p->levels[0] = source;
+    p->num_levels = 1;
+    int w = source.width, h = source.height;
+    while ((w > TILE_SIZE || h > TILE_SIZE) && p->num_levels < TILE_MAX_LEVELS) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        Image& level = p->levels[p->num_levels++];
+        level = source;
+        level.width = w;
+        level.height = h;
+        level.data = malloc((std::size_t) w * h * p->bytes_per_pixel);
+        assert(level.data);
+    }
+    for (int k = 0; k < p->num_levels; k++) {
+        p->tiles_x[k] = (p->levels[k].width + TILE_SIZE - 1) / TILE_SIZE;
+        p->tiles_y[k] = (p->levels[k].height + TILE_SIZE - 1) / TILE_SIZE;
+        p->tiles[k].resize(p->tiles_x[k] * p->tiles_y[k]);
+    }
+    p->levels_ready.store(1);
+    p->cancel.store(false);
+    p->build = std::make_shared<std::atomic<int>>(p->num_levels > 1 ? TILE_BUILD_QUEUED : TILE_BUILD_DONE);
+    if (p->num_levels > 1) {
+        PoolSubmitJob([p, build = p->build]() {
+            // p is only touched once claimed: a pyramid unloaded before that has dropped its build.
+            int queued = TILE_BUILD_QUEUED;
+            if (build->compare_exchange_strong(queued, TILE_BUILD_RUNNING)) tile_pyramid_build(p);
+        });
+    }
+    GetTilePyramids().live.push_back(p);
+    return p;
+}
+
+void
+UnloadTilePyramid(TilePyramid *p) {
+    if (p == nullptr) return;
+    p->cancel.store(true);
+    tile_pyramid_wait(p, false);
+    std::vector<TilePyramid*>& live = GetTilePyramids().live;
+    live.erase(std::find(live.begin(), live.end(), p));
+    for (auto & r : p->resident) UnloadTexture(p->tiles[r.first][r.second].tex);
+    for (int k = 1; k < p->num_levels; k++) free(p->levels[k].data);
+    delete p;
+}
+
+static void
+tile_mark_dirty(PyramidTile& tile, int x0, int y0, int x1, int y1) {
+    // Grows the tile's dirty rectangle, coordinates relative to the tile.
+    if (tile.dirty.width > 0 && tile.dirty.height > 0) {
+        x0 = fmin(x0, tile.dirty.x);
+        y0 = fmin(y0, tile.dirty.y);
+        x1 = fmax(x1, tile.dirty.x + tile.dirty.width);
+        y1 = fmax(y1, tile.dirty.y + tile.dirty.height);
+    }
+    tile.dirty = (Rectangle) {(float) x0, (float) y0, (float) (x1 - x0), (float) (y1 - y0)};
+}
+
+void
+TilePyramidUpdate(TilePyramid *p, Rectangle pixels) {
+    // The source changed inside pixels: refresh the coarser levels there and mark tiles dirty.
+    if (p == nullptr) return;
+    tile_pyramid_wait(p);
+    p->levels_ready.store(p->num_levels);
+    int x0 = fmax(floorf(pixels.x), 0), y0 = fmax(floorf(pixels.y), 0);
+    int x1 = fmin(ceilf(pixels.x + pixels.width), p->width);
+    int y1 = fmin(ceilf(pixels.y + pixels.height), p->height);
+    for (int k = 0; k < p->num_levels && x1 > x0 && y1 > y0; k++) {
+        if (k > 0) {
+            x0 /= 2; y0 /= 2;
+            x1 = fmin((x1 + 1) / 2, p->levels[k].width);
+            y1 = fmin((y1 + 1) / 2, p->levels[k].height);
+            tile_downsample_rect(p->levels[k-1], p->levels[k], x0, y0, x1, y1, p->bytes_per_pixel, p->reduce);
+        }
+        for (int ty = y0 / TILE_SIZE; ty <= (y1 - 1) / TILE_SIZE; ty++) {
+            for (int tx = x0 / TILE_SIZE; tx <= (x1 - 1) / TILE_SIZE; tx++) {
+                PyramidTile& tile = p->tiles[k][ty * p->tiles_x[k] + tx];
+                if (tile.tex.id == 0) continue; // Uploaded whole when needed
+                int ox = tx * TILE_SIZE, oy = ty * TILE_SIZE;
+                tile_mark_dirty(tile, MAXVAL(x0, ox) - ox, MAXVAL(y0, oy) - oy,
+                    fmin(x1, ox + TILE_SIZE) - ox, fmin(y1, oy + TILE_SIZE) - oy);
+            }
+        }
+    }
+}
+
+static void
+TilePyramidUpload(TilePyramid *p, int level, int tx, int ty) {
+    PROFILE_SCOPE("texture upload");
+    PyramidTile& tile = p->tiles[level][ty * p->tiles_x[level] + tx];
+    Image& src = p->levels[level];
+    int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE;
+    int w = src.width - x0 < TILE_SIZE ? src.width - x0 : TILE_SIZE;
+    int h = src.height - y0 < TILE_SIZE ? src.height - y0 : TILE_SIZE;
+    Rectangle rec = {0, 0, (float) w, (float) h};
+    if (tile.tex.id > 0) {
+        // Resident tile, only its dirty rectangle goes to the GPU.
+        rec = tile.dirty;
+        x0 += rec.x;
+        y0 += rec.y;
+        w = rec.width;
+        h = rec.height;
+    }
+    int bpp = p->bytes_per_pixel;
+    Image region = {0};
+    region.data = malloc((std::size_t) w * h * bpp);
+    region.width = w;
+    region.height = h;
+    region.mipmaps = 1;
+    region.format = p->format;
+    for (int y = 0; y < h; y++) {
+        memcpy((uint8_t*) region.data + (std::size_t) y * w * bpp, (uint8_t*) src.data + ((std::size_t) (y0 + y) * src.width + x0) * bpp, (std::size_t) w * bpp);
+    }
+    if (tile.tex.id > 0) {
+        UpdateTextureRec(tile.tex, rec, region.data);
+    } else {
+        tile.tex = LoadTextureFromImage(region);
+        p->resident.push_back({level, ty * p->tiles_x[level] + tx});
+    }
+    UnloadImage(region);
+    tile.dirty = (Rectangle) {0};
+}
+
+static void
+tile_draw_region(const Texture2D& tex, int factor, float ox, float oy, float x0, float y0, float w, float h,
+                 Rectangle dest, float sx, float sy, float rotation, Color tint) {
+    // Level 0 pixels [x0, x0 + w) x [y0, y0 + h) from tex, a tile of a level with factor whose top left is level 0 pixel (ox, oy).
+    Rectangle src = {(x0 - ox) / factor, (y0 - oy) / factor, w / factor, h / factor};
+    DrawTexturePro(tex, src, (Rectangle) {dest.x, dest.y, w * sx, h * sy}, (Vector2) {-x0 * sx, -y0 * sy}, rotation, tint);
+}
+
+void
+DrawTilePyramid(TilePyramid *p, Rectangle dest, float rotation, Color tint, Camera2D camera) {
+/*
+    Draws the pyramid as DrawTexturePro(tex, full source, dest, {0,0}, rotation, tint)
+    would, from the tiles of the level matching the zoom that are on screen.
+*/
+    if (p == nullptr || p->width == 0 || p->height == 0) return;
+    int frame = GetTilePyramids().frame;
+    float sx = dest.width / p->width, sy = dest.height / p->height;
+
+    // One level-0 pixel spans sx * zoom screen pixels, go coarser until it spans about one.
+    float span = fmin(fabs(sx), fabs(sy)) * camera.zoom;
+    int level = span > 0 ? (int) floorf(log2f(1.f / span)) : 0;
+    level = level < 0 ? 0 : level;
+    int ready = p->levels_ready.load();
+    level = level < ready ? level : ready - 1;
+    int factor = 1 << level;
+
+    // Visible screen corners in level-0 pixels (undoing the rotation around dest.x, dest.y).
+    Vector2 corners[4] = {
+        GetScreenToWorld2D((Vector2) {0, 0}, camera),
+        GetScreenToWorld2D((Vector2) {(float) GetScreenWidth(), 0}, camera),
+        GetScreenToWorld2D((Vector2) {0, (float) GetScreenHeight()}, camera),
+        GetScreenToWorld2D((Vector2) {(float) GetScreenWidth(), (float) GetScreenHeight()}, camera),
+    };
+    float c = cosf(-rotation * DEG2RAD), s = sinf(-rotation * DEG2RAD);
+    float u0 = INFINITY, v0 = INFINITY, u1 = -INFINITY, v1 = -INFINITY;
+    for (auto & corner : corners) {
+        float dx = corner.x - dest.x, dy = corner.y - dest.y;
+        float u = (c * dx - s * dy) / sx;
+        float v = (s * dx + c * dy) / sy;
+        u0 = fmin(u0, u); u1 = fmax(u1, u);
+        v0 = fmin(v0, v); v1 = fmax(v1, v);
+    }
+    int span_px = TILE_SIZE * factor;
+    int tx0 = fmax(floorf(u0 / span_px), 0), tx1 = fmin(floorf(u1 / span_px), p->tiles_x[level] - 1);
+    int ty0 = fmax(floorf(v0 / span_px), 0), ty1 = fmin(floorf(v1 / span_px), p->tiles_y[level] - 1);
+
+    int uploads = 0;
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            PyramidTile& tile = p->tiles[level][ty * p->tiles_x[level] + tx];
+            if ((tile.tex.id == 0 || tile.dirty.width > 0) && uploads < TILE_UPLOADS_PER_FRAME) {
+                TilePyramidUpload(p, level, tx, ty);
+                uploads++;
+            }
+            float x0 = tx * span_px, y0 = ty * span_px;
+            float w = fmin(TILE_SIZE, p->levels[level].width - tx * TILE_SIZE) * factor;
+            float h = fmin(TILE_SIZE, p->levels[level].height - ty * TILE_SIZE) * factor;
+            if (tile.tex.id > 0) {
+                tile.last_used = frame;
+                tile_draw_region(tile.tex, factor, x0, y0, x0, y0, w, h, dest, sx, sy, rotation, tint);
+                continue;
+            }
+            // Over the upload budget until a next frame: its part of the first resident coarser tile.
+            for (int k = level + 1; k < ready; k++) {
+                int span_k = TILE_SIZE << k;
+                int cx = tx * span_px / span_k, cy = ty * span_px / span_k;
+                PyramidTile& coarse = p->tiles[k][cy * p->tiles_x[k] + cx];
+                if (coarse.tex.id == 0) continue;
+                coarse.last_used = frame;
+                tile_draw_region(coarse.tex, 1 << k, cx * span_k, cy * span_k, x0, y0, w, h, dest, sx, sy, rotation, tint);
+                break;
+            }
+        }
+    }
+}
+
+void
+TilePyramidsFrameEnd() {
+    // Main thread, once per frame: unloads the tiles of every pyramid that were not drawn for a while.
+    TilePyramids& pyramids = GetTilePyramids();
+    int frame = pyramids.frame++;
+    for (TilePyramid *p : pyramids.live) {
+        for (std::size_t i = 0; i < p->resident.size();) {
+            PyramidTile& tile = p->tiles[p->resident[i].first][p->resident[i].second];
+            if (frame - tile.last_used <= TILE_EVICT_FRAMES) {
+                i++;
+                continue;
+            }
+            UnloadTexture(tile.tex);
+            tile.tex = {0};
+            tile.dirty = (Rectangle) {0};
+            p->resident[i] = p->resident.back();
+            p->resident.pop_back();
+        }
+    }
+}
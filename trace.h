@@ -0,0 +1,151 @@
+// Execution trace, exported as Chrome trace JSON (chrome://tracing, Perfetto).
+//
+// Every thread records complete events (name, start, duration) in its own
+// ring buffer, so recording takes no lock and only the owner writes. The
+// ring keeps the last TRACE_RING_SIZE events of the thread. A snapshot copies
+// the rings while they are written and drops what may have been overwritten
+// during the copy.
+#define TRACE_RING_SIZE (1 << 15)
+#define TRACE_NAME_SIZE 48
+
+struct TraceEvent {
+    char name[TRACE_NAME_SIZE];
+    const char *category;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+struct TraceRing {
+    TraceEvent events[TRACE_RING_SIZE];
+    std::atomic<uint64_t> head{0};  // Events written so far
+    int tid;
+    char thread_name[32];
+};
+
+struct Tracer {
+    std::mutex lock;                // Guards rings
+    std::vector<TraceRing*> rings;  // Never freed, threads live as long as the app
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+Tracer&
+GetTracer() {
+    static Tracer tracer;
+    return tracer;
+}
+
+static thread_local TraceRing *trace_ring = nullptr;
+
+static TraceRing *
+trace_thread_ring() {
+    if (trace_ring) return trace_ring;
+    Tracer& t = GetTracer();
+    std::lock_guard<std::mutex> guard(t.lock);
+    trace_ring = new TraceRing();
+    trace_ring->tid = t.rings.size();
+    snprintf(trace_ring->thread_name, sizeof(trace_ring->thread_name), "thread %d", (int) t.rings.size());
+    t.rings.push_back(trace_ring);
+    return trace_ring;
+}
+
+uint64_t
+TraceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - GetTracer().epoch).count();
+}
+
+void
+TraceSetThreadName(const char *name) {
+    TraceRing *ring = trace_thread_ring();
+    snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", name);
+}
+
+void
+TraceRecord(const char *name, const char *category, uint64_t start_ns, uint64_t duration_ns) {
+    TraceRing *ring = trace_thread_ring();
+    uint64_t h = ring->head.load(std::memory_order_relaxed);
+    TraceEvent& e = ring->events[h % TRACE_RING_SIZE];
+    snprintf(e.name, TRACE_NAME_SIZE, "%s", name);
+    e.category = category;
+    e.start_ns = start_ns;
+    e.duration_ns = duration_ns;
+    ring->head.store(h + 1, std::memory_order_release);
+}
+
+struct TraceScope {
+    const char *name;
+    const char *category;
+    uint64_t start;
+    TraceScope(const char *n, const char *c) : name(n), category(c), start(TraceNow()) {}
+    ~TraceScope() { TraceRecord(name, category, start, TraceNow() - start); }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Records the rest of the enclosing block as one event.
+#define TRACE_SCOPE(name, category) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, category)
+
+struct TraceSnapshot {
+    std::vector<TraceEvent> events;
+    std::vector<int> tids;          // Thread of each event
+    std::vector<std::pair<int, std::string>> threads;
+};
+
+void
+TraceTakeSnapshot(TraceSnapshot& snapshot) {
+    // Copies the events of every thread, the rings are left as they are.
+    Tracer& t = GetTracer();
+    std::lock_guard<std::mutex> guard(t.lock);
+    for (TraceRing *ring : t.rings) {
+        // Event i lives in slot i % TRACE_RING_SIZE, and the owner may be writing event head
+        // into the slot of the oldest one, so with a full ring that one is never read.
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head >= TRACE_RING_SIZE ? head - TRACE_RING_SIZE + 1 : 0;
+        std::size_t base = snapshot.events.size();
+        for (uint64_t i = first; i < head; i++) snapshot.events.push_back(ring->events[i % TRACE_RING_SIZE]);
+        // Slots reused during the copy, or being written now, may hold newer events, they are dropped.
+        uint64_t after = ring->head.load(std::memory_order_acquire);
+        uint64_t safe = after >= TRACE_RING_SIZE ? after - TRACE_RING_SIZE + 1 : 0;
+        uint64_t reused = safe > first ? safe - first : 0;
+        std::size_t keep_from = base + (reused < head - first ? reused : head - first);
+        snapshot.events.erase(snapshot.events.begin() + base, snapshot.events.begin() + keep_from);
+        snapshot.tids.resize(snapshot.events.size(), ring->tid);
+        snapshot.threads.push_back({ring->tid, ring->thread_name});
+    }
+}
+
+static void
+trace_write_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        if ((unsigned char) *s >= 0x20) fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+bool
+TraceWriteChrome(const TraceSnapshot& snapshot, const char *filename) {
+    // Complete ("X") events in microseconds, plus the thread names.
+    FILE *f = fopen(filename, "w");
+    if (!f) return false;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *sep = "";
+    for (auto & thread : snapshot.threads) {
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", sep, thread.first);
+        trace_write_string(f, thread.second.c_str());
+        fprintf(f, "}}");
+        sep = ",\n";
+    }
+    for (std::size_t i = 0; i < snapshot.events.size(); i++) {
+        const TraceEvent& e = snapshot.events[i];
+        fprintf(f, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"cat\":", sep, snapshot.tids[i], e.start_ns * 1e-3, e.duration_ns * 1e-3);
+        trace_write_string(f, e.category);
+        fprintf(f, ",\"name\":");
+        trace_write_string(f, e.name);
+        fprintf(f, "}");
+        sep = ",\n";
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return true;
+}